@@ -127,6 +127,13 @@ static bool load_image_from_file(const std::string & fname, sam_image_u8 & img)
     return true;
 }
 
+// options of this example that are not part of sam_params
+struct sam_example_params {
+    int n_bench = 0; // > 0: benchmark the decoder with this many iterations per configuration and exit
+
+    bool f16_act_check = false; // compare the embedding and the masks of --f16-act against F32 and exit
+};
+
 static void print_usage(int argc, char ** argv, const sam_params & params) {
     fprintf(stderr, "usage: %s [options]\n", argv[0]);
     fprintf(stderr, "\n");
@@ -134,6 +141,12 @@ static void print_usage(int argc, char ** argv, const sam_params & params) {
     fprintf(stderr, "  -h, --help            show this help message and exit\n");
     fprintf(stderr, "  -s SEED, --seed SEED  RNG seed (default: -1)\n");
     fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
+    fprintf(stderr, "  --autotune            benchmark and pick the number of encoder and decoder threads (cached in <model>.autotune)\n");
+    fprintf(stderr, "  --autotune-cache FNAME\n");
+    fprintf(stderr, "                        file to cache the --autotune result in (default: <model>.autotune)\n");
+    fprintf(stderr, "  --f16-act             store the encoder attention keys and values in F16 (faster, slightly less accurate)\n");
+    fprintf(stderr, "  --bench N             time N decoder runs per prompt configuration on the input image and exit\n");
+    fprintf(stderr, "  --f16-act-check       compare the image embedding and the masks of --f16-act against F32 and exit\n");
     fprintf(stderr, "  -m FNAME, --model FNAME\n");
     fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
     fprintf(stderr, "  -i FNAME, --inp FNAME\n");
@@ -143,7 +156,7 @@ static void print_usage(int argc, char ** argv, const sam_params & params) {
     fprintf(stderr, "\n");
 }
 
-static bool params_parse(int argc, char ** argv, sam_params & params) {
+static bool params_parse(int argc, char ** argv, sam_params & params, sam_example_params & params_ex) {
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
 
@@ -151,6 +164,16 @@ static bool params_parse(int argc, char ** argv, sam_params & params) {
             params.seed = std::stoi(argv[++i]);
         } else if (arg == "-t" || arg == "--threads") {
             params.n_threads = std::stoi(argv[++i]);
+        } else if (arg == "--autotune") {
+            params.autotune = true;
+        } else if (arg == "--autotune-cache") {
+            params.autotune_cache = argv[++i];
+        } else if (arg == "--f16-act") {
+            params.f16_activations = true;
+        } else if (arg == "--bench") {
+            params_ex.n_bench = std::stoi(argv[++i]);
+        } else if (arg == "--f16-act-check") {
+            params_ex.f16_act_check = true;
         } else if (arg == "-m" || arg == "--model") {
             params.model = argv[++i];
         } else if (arg == "-i" || arg == "--inp") {
@@ -170,6 +193,147 @@ static bool params_parse(int argc, char ** argv, sam_params & params) {
     return true;
 }
 
+// decoder microbenchmark: time the decoder graph for single and batched prompts, with one and with three output
+// masks, and report the size of its compute buffer. the single-threaded postprocessing is not part of the timing
+static void bench_decoder(const sam_image_u8 & img, const sam_params & params, sam_state & state, int n_iter) {
+    for (int n_points : { 1, 8 }) {
+        std::vector<sam_point> points;
+        for (int i = 0; i < n_points; ++i) {
+            sam_point pt;
+            pt.x = img.nx*(i + 0.5f)/n_points;
+            pt.y = img.ny*0.5f;
+            points.push_back(pt);
+        }
+
+        for (bool multimask_output : { false, true }) {
+            // warm up, so that the compute buffer is already allocated
+            sam_compute_masks_batch(img.nx, img.ny, params.n_threads, points, state, 255, 0, multimask_output);
+
+            double t_min_ms = 0.0;
+            double t_sum_ms = 0.0;
+            for (int it = 0; it < n_iter; ++it) {
+                auto masks = sam_compute_masks_batch(img.nx, img.ny, params.n_threads, points, state, 255, 0, multimask_output);
+                if (masks.empty()) {
+                    fprintf(stderr, "%s: failed to compute masks\n", __func__);
+                    return;
+                }
+
+                const double t_ms = state.t_compute_masks_graph_us/1000.0;
+
+                t_min_ms = it == 0 ? t_ms : std::min(t_min_ms, t_ms);
+                t_sum_ms += t_ms;
+            }
+
+            printf("decoder: points = %d, multimask = %d: min = %8.2f ms, avg = %8.2f ms, compute buffer = %7.2f MB\n",
+                    n_points, multimask_output, t_min_ms, t_sum_ms/n_iter, state.mem_compute_masks/(1024.0*1024.0));
+        }
+    }
+}
+
+// accuracy check of --f16-act: encode the image with F32 and with F16 attention keys and values, and compare the
+// embeddings and the single-mask output for a grid of point prompts
+static bool check_f16_act(const sam_image_u8 & img, sam_params params) {
+    // compare the embeddings as F32
+    params.embd_type = SAM_EMBD_TYPE_F32;
+
+    std::shared_ptr<sam_state> state[2];
+    for (int i = 0; i < 2; ++i) {
+        params.f16_activations = i == 1;
+
+        state[i] = sam_load_model(params);
+        if (!state[i]) {
+            fprintf(stderr, "%s: failed to load model\n", __func__);
+            return false;
+        }
+
+        if (!sam_compute_embd_img(img, params.n_threads, *state[i])) {
+            fprintf(stderr, "%s: failed to compute encoded image\n", __func__);
+            return false;
+        }
+        printf("f16_act = %d: t_compute_img_ms = %d ms\n", i, state[i]->t_compute_img_ms);
+    }
+
+    {
+        const std::vector<uint8_t> embd0 = sam_get_embd_img(*state[0]);
+        const std::vector<uint8_t> embd1 = sam_get_embd_img(*state[1]);
+        if (embd0.empty() || embd0.size() != embd1.size()) {
+            fprintf(stderr, "%s: embedding size mismatch\n", __func__);
+            return false;
+        }
+
+        const float * e0 = (const float *) embd0.data();
+        const float * e1 = (const float *) embd1.data();
+        const size_t n = embd0.size()/sizeof(float);
+
+        double diff_max = 0.0;
+        double diff_sum = 0.0;
+        double abs_sum  = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            const double d = std::fabs((double) e0[i] - e1[i]);
+            diff_max  = std::max(diff_max, d);
+            diff_sum += d;
+            abs_sum  += std::fabs(e0[i]);
+        }
+
+        printf("embedding: max abs diff = %.6f, mean abs diff = %.6f, mean abs value = %.6f\n",
+                diff_max, diff_sum/n, abs_sum/n);
+    }
+
+    const int n_grid = 4;
+
+    double iou_sum = 0.0;
+    double iou_min = 1.0;
+    int    n_iou   = 0;
+    for (int gy = 0; gy < n_grid; ++gy) {
+        for (int gx = 0; gx < n_grid; ++gx) {
+            sam_point pt;
+            pt.x = img.nx*(gx + 0.5f)/n_grid;
+            pt.y = img.ny*(gy + 0.5f)/n_grid;
+
+            const auto masks0 = sam_compute_masks(img, params.n_threads, pt, *state[0], 1, 0, false);
+            const auto masks1 = sam_compute_masks(img, params.n_threads, pt, *state[1], 1, 0, false);
+
+            // a mask can be dropped by the score thresholds
+            if (masks0.empty() != masks1.empty()) {
+                printf("point (%6.1f, %6.1f): mask only in %s\n", pt.x, pt.y, masks0.empty() ? "F16" : "F32");
+                iou_min = 0.0;
+                n_iou++;
+                continue;
+            }
+            if (masks0.empty()) {
+                continue;
+            }
+
+            const auto & m0 = masks0[0].data;
+            const auto & m1 = masks1[0].data;
+
+            int n_and = 0;
+            int n_or  = 0;
+            for (size_t i = 0; i < m0.size(); ++i) {
+                n_and += m0[i] & m1[i];
+                n_or  += m0[i] | m1[i];
+            }
+
+            const double iou = n_or > 0 ? (double) n_and/n_or : 1.0;
+            printf("point (%6.1f, %6.1f): mask IoU = %.4f\n", pt.x, pt.y, iou);
+
+            iou_sum += iou;
+            iou_min  = std::min(iou_min, iou);
+            n_iou++;
+        }
+    }
+
+    if (n_iou > 0) {
+        printf("masks: %d prompts, mean IoU = %.4f, min IoU = %.4f\n", n_iou, iou_sum/n_iou, iou_min);
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        sam_deinit(*state[i]);
+    }
+
+    return true;
+}
+
 bool ImGui_BeginFrame(SDL_Window * window) {
     ImGui_NewFrame(window);
 
@@ -260,6 +424,7 @@ int main_loop(sam_image_u8 img, const sam_params & params, sam_state & state) {
     std::vector<GLuint> maskTextures;
     bool segmentOnMove = false;
     bool outputMultipleMasks = false;
+    bool outputMultipleMasksLast = false;
 
     while (!done) {
         bool computeMasks = false;
@@ -311,14 +476,20 @@ int main_loop(sam_image_u8 img, const sam_params & params, sam_state & state) {
             computeMasks = true;
         }
 
+        // the single-mask path decodes only one mask, so recompute when switching modes
+        if (outputMultipleMasks != outputMultipleMasksLast) {
+            computeMasks = true;
+        }
+
         xLast = x;
         yLast = y;
+        outputMultipleMasksLast = outputMultipleMasks;
 
         if (computeMasks) {
             sam_point pt { x, y};
             printf("pt = (%f, %f)\n", pt.x, pt.y);
 
-            masks = sam_compute_masks(img, params.n_threads, pt, state);
+            masks = sam_compute_masks(img, params.n_threads, pt, state, 255, 0, outputMultipleMasks);
 
             if (!maskTextures.empty()) {
                 glDeleteTextures(maskTextures.size(), maskTextures.data());
@@ -383,7 +554,8 @@ int main_loop(sam_image_u8 img, const sam_params & params, sam_state & state) {
 
 int main(int argc, char ** argv) {
     sam_params params;
-    if (!params_parse(argc, argv, params)) {
+    sam_example_params params_ex;
+    if (!params_parse(argc, argv, params, params_ex)) {
         return 1;
     }
 
@@ -400,6 +572,31 @@ int main(int argc, char ** argv) {
     }
     fprintf(stderr, "%s: loaded image '%s' (%d x %d)\n", __func__, params.fname_inp.c_str(), img0.nx, img0.ny);
 
+    // the benchmark runs without a window
+    if (params_ex.n_bench > 0) {
+        std::shared_ptr<sam_state> state = sam_load_model(params);
+        if (!state) {
+            fprintf(stderr, "%s: failed to load model\n", __func__);
+            return 1;
+        }
+
+        if (!sam_compute_embd_img(img0, params.n_threads, *state)) {
+            fprintf(stderr, "%s: failed to compute encoded image\n", __func__);
+            return 1;
+        }
+        printf("t_compute_img_ms = %d ms\n", state->t_compute_img_ms);
+
+        bench_decoder(img0, params, *state, params_ex.n_bench);
+
+        sam_deinit(*state);
+
+        return 0;
+    }
+
+    if (params_ex.f16_act_check) {
+        return check_f16_act(img0, params) ? 0 : 1;
+    }
+
     // init SDL video subsystem to get the screen size
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         fprintf(stderr, "Error: %s\n", SDL_GetError());
@@ -5,12 +5,19 @@
 #include "ggml-alloc.h"
 #include "ggml-backend.h"
 
+#include <atomic>
 #include <cassert>
 #include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <list>
 #include <map>
+#include <mutex>
+#include <set>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -85,6 +92,10 @@ struct sam_layer_enc {
     struct ggml_tensor * rel_pos_w;
     struct ggml_tensor * rel_pos_h;
 
+    // rel_pos_w/h gathered for the attention size of the layer at load time, see sam_rel_pos_gather
+    struct ggml_tensor * rel_pos_w_tab;
+    struct ggml_tensor * rel_pos_h_tab;
+
     struct ggml_tensor * qkv_w;
     struct ggml_tensor * qkv_b;
 
@@ -114,6 +125,9 @@ struct sam_encoder_image {
     struct ggml_tensor * neck_norm_1_w;
     struct ggml_tensor * neck_norm_1_b;
 
+    // neck_conv_1 reordered at load time into one [C_in, C_out] matrix per tap, see sam_conv_2d_3x3
+    struct ggml_tensor * neck_conv_1_taps;
+
     std::vector<sam_layer_enc> layers;
 };
 
@@ -124,8 +138,21 @@ struct sam_encoder_prompt {
     std::vector<struct ggml_tensor *> pt_embd;
 
     struct ggml_tensor * no_mask_embd_w;
-    //std::vector<struct ggml_tensor *> mask_down_w;
-    //std::vector<struct ggml_tensor *> mask_down_b;
+
+    // mask_downscaling - optional, older model files do not contain it
+    // conv 2x2 s2 -> LayerNorm2d -> GELU -> conv 2x2 s2 -> LayerNorm2d -> GELU -> conv 1x1
+    bool has_mask_down = false;
+
+    struct ggml_tensor * mask_down_0_w;
+    struct ggml_tensor * mask_down_0_b;
+    struct ggml_tensor * mask_down_1_w;
+    struct ggml_tensor * mask_down_1_b;
+    struct ggml_tensor * mask_down_3_w;
+    struct ggml_tensor * mask_down_3_b;
+    struct ggml_tensor * mask_down_4_w;
+    struct ggml_tensor * mask_down_4_b;
+    struct ggml_tensor * mask_down_6_w;
+    struct ggml_tensor * mask_down_6_b;
 };
 
 struct  sam_layer_dec_transformer_attn {
@@ -214,9 +241,25 @@ struct sam_decoder_mask {
     struct ggml_tensor * output_upscaling_3_w;
     struct ggml_tensor * output_upscaling_3_b;
 
+    // prepared at load time for sam_conv_transpose_2d_k2s2_gelu: the reordered output_upscaling_{0,3} weights and
+    // the output_upscaling.1 weight and bias stacked into one tensor
+    struct ggml_tensor * output_upscaling_0_w_t;
+    struct ggml_tensor * output_upscaling_3_w_t;
+    struct ggml_tensor * output_upscaling_1_wb;
+
     // output_hypernetworks_mlps
     std::vector<sam_layer_dec_output_hypernet_mlps> output_hypernet_mlps;
 
+    // the output_hypernetworks_mlps weights stacked along dim 2, so that the MLPs of all selected mask tokens run
+    // as one batched matmul per layer. the tensors in output_hypernet_mlps are views of their slices, so the weights
+    // are loaded directly into the stacked tensors
+    struct ggml_tensor * output_hypernet_w_0;
+    struct ggml_tensor * output_hypernet_b_0;
+    struct ggml_tensor * output_hypernet_w_1;
+    struct ggml_tensor * output_hypernet_b_1;
+    struct ggml_tensor * output_hypernet_w_2;
+    struct ggml_tensor * output_hypernet_b_2;
+
     // iou_prediction_head.0
     struct ggml_tensor * iou_prediction_head_0_w;
     struct ggml_tensor * iou_prediction_head_0_b;
@@ -243,26 +286,101 @@ struct sam_ggml_model {
     sam_encoder_prompt enc_prompt;
     sam_decoder_mask   dec;
 
+    // the backend that owns the weights buffer - the sessions compute with their own backend instances
     ggml_backend_t backend = {};
     ggml_backend_buffer_t buffer = {};
 
 
     //
-    struct ggml_context * ctx;
+    struct ggml_context * ctx = {};
     std::map<std::string, struct ggml_tensor *> tensors;
+
+    // tensors that may be missing from the model file
+    std::set<std::string> tensors_optional;
+
+    ~sam_ggml_model() {
+        if (ctx) {
+            ggml_free(ctx);
+        }
+        if (buffer) {
+            ggml_backend_buffer_free(buffer);
+        }
+        if (backend) {
+            ggml_backend_free(backend);
+        }
+    }
 };
 
 struct sam_ggml_state {
     struct ggml_tensor * embd_img = {};
+    struct ggml_tensor * embd_img_scale = {}; // per-channel scale of an int8 embd_img
+
+    // storage type of embd_img, see sam_params.embd_type
+    enum ggml_type embd_type = GGML_TYPE_F32;
+
+    // holds embd_img and the decoder image cache below - created on the first image and reused for the next ones
+    // the tensor data lives in buf_img, which is sized exactly for these tensors
     struct ggml_context * ctx_img = {};
+    ggml_backend_buffer_t buf_img = {};
+
+    // image-only inputs of the mask decoder, computed once per image when precompute_dec_kv is set
+    // see sam_build_dec_img_cache_graph
+    struct ggml_tensor * pe_img = {}; // dense positional encoding  [C, W, H]
+    struct ggml_tensor * dec_k0 = {}; // first layer token-to-image keys   [n_embd_head, W*H, n_head]
+    struct ggml_tensor * dec_v0 = {}; // first layer token-to-image values [W*H, n_embd_head, n_head]
+
+    bool precompute_dec_kv = true;
+
+    // keep the encoder attention keys and values in F16, see sam_params.f16_activations
+    bool f16_act = false;
 
     struct ggml_tensor * low_res_masks = {};
     struct ggml_tensor * iou_predictions = {};
     struct ggml_context * ctx_masks = {};
 
+    // data of low_res_masks and iou_predictions, grows to the largest batch decoded so far
+    ggml_backend_buffer_t buf_masks = {};
+
     //struct ggml_tensor * tmp_save = {};
 
     struct ggml_allocr  * allocr = {};
+
+    // per-session compute resources, so that sessions sharing a model do not touch each other's memory
+    // they are kept for the lifetime of the session and reused by every graph computation
+    ggml_backend_t backend = {};
+
+    // compute buffer of the decoder graphs, grows to the largest one computed so far, see sam_ggml_graph_compute
+    ggml_backend_buffer_t buf_compute = {};
+
+    // holds the ggml_tensor and ggml_cgraph structs of the graphs built by this session
+    std::vector<uint8_t> buf_compute_meta;
+
+    // duration of the last graph computation in sam_ggml_graph_compute, without building and allocating the graph
+    int64_t t_graph_compute_us = 0;
+
+    // compute buffer size measured for the last graph in sam_ggml_graph_compute
+    size_t mem_graph_compute = 0;
+
+    ~sam_ggml_state() {
+        if (ctx_img) {
+            ggml_free(ctx_img);
+        }
+        if (ctx_masks) {
+            ggml_free(ctx_masks);
+        }
+        if (buf_img) {
+            ggml_backend_buffer_free(buf_img);
+        }
+        if (buf_masks) {
+            ggml_backend_buffer_free(buf_masks);
+        }
+        if (buf_compute) {
+            ggml_backend_buffer_free(buf_compute);
+        }
+        if (backend) {
+            ggml_backend_free(backend);
+        }
+    }
 };
 
 // void save_tensor(sam_state& state, struct ggml_tensor * t, struct ggml_cgraph * gf) {
@@ -306,41 +424,299 @@ static void ggml_disconnect_node_from_graph(ggml_tensor * t) {
     }
 }
 
-static void ggml_sam_sin(struct ggml_tensor * dst , const struct ggml_tensor * src, int ith, int nth, void * userdata) {
+// sin and cos of 2*pi*x for every row of src, written as the concatenation [sin | cos] into the rows of dst
+// ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/prompt_encoder.py#L192
+//
+// the argument is reduced to [-pi/4, pi/4] with a 3-part Cody-Waite reduction by pi/2 and both functions are
+// evaluated with the cephes minimax polynomials. the quadrant fix-up is done with selects instead of branches,
+// so the inner loop is vectorized by the compiler
+static void ggml_sam_sincos(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * src, int ith, int nth, void * userdata) {
     GGML_ASSERT(userdata == NULL);
-    GGML_ASSERT(ggml_are_same_shape(dst, src));
+    GGML_ASSERT(dst->ne[0] == 2*src->ne[0]);
+    GGML_ASSERT(ggml_nrows(dst) == ggml_nrows(src));
     GGML_ASSERT(ggml_is_contiguous(dst));
     GGML_ASSERT(ggml_is_contiguous(src));
+    GGML_ASSERT(src->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32);
+
+    (void) a;
+
+    const int nc = (int)src->ne[0];
+    const int nr = (int)ggml_nrows(src);
+    const int dr = (nr + nth - 1) / nth;
+    const int ir0 = dr * ith;
+    const int ir1 = std::min(ir0 + dr, nr);
+
+    const float two_pi      = float(2.0*M_PI);
+    const float two_over_pi = float(2.0/M_PI);
+
+    // pi/2 split so that q*PIO2_1 and q*PIO2_2 are exact
+    const float PIO2_1 = 1.5703125f;
+    const float PIO2_2 = 4.837512969970703125e-4f;
+    const float PIO2_3 = 7.54978995489188216e-8f;
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const float * x = (const float *) ((const char *) src->data + ir*src->nb[1]);
+              float * s = (      float *) ((      char *) dst->data + ir*dst->nb[1]);
+              float * c = s + nc;
+
+        for (int i = 0; i < nc; ++i) {
+            const float t = two_pi*x[i];
+
+            const int   q = (int) (t*two_over_pi + (t >= 0.0f ? 0.5f : -0.5f));
+            const float qf = (float) q;
 
-    const float * src_data = ggml_get_data_f32(src);
-    float * dst_data = ggml_get_data_f32(dst);
+            const float r = ((t - qf*PIO2_1) - qf*PIO2_2) - qf*PIO2_3;
+            const float z = r*r;
 
-    const int ne = (int)ggml_nelements(dst);
-    const int dr = (ne + nth - 1) / nth;
-    const int ie0 = dr * ith;
-    const int ie1 = std::min(ie0 + dr, ne);
+            const float ps = ((-1.9515295891e-4f*z + 8.3321608736e-3f)*z - 1.6666654611e-1f)*z*r + r;
+            const float pc = ((2.443315711809948e-5f*z - 1.388731625493765e-3f)*z + 4.166664568298827e-2f)*z*z - 0.5f*z + 1.0f;
 
-    for (int i = ie0; i < ie1; ++i) {
-        dst_data[i] = sinf(src_data[i]);
+            // quadrant: q & 1 swaps sin and cos, q & 2 flips the sign of sin, (q + 1) & 2 flips the sign of cos
+            const bool swap = (q & 1) != 0;
+
+            const float vs = swap ? pc : ps;
+            const float vc = swap ? ps : pc;
+
+            s[i] = (q & 2)       ? -vs : vs;
+            c[i] = ((q + 1) & 2) ? -vc : vc;
+        }
     }
 }
 
-static void ggml_sam_cos(struct ggml_tensor * dst , const struct ggml_tensor * src, int ith, int nth, void * userdata) {
+// ggml_sam_sincos of cur into a new [2*ne0, ne1, ne2, ne3] tensor
+static struct ggml_tensor * sam_sincos(struct ggml_context * ctx0, struct ggml_tensor * cur) {
+    struct ggml_tensor * out = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, 2*cur->ne[0], cur->ne[1], cur->ne[2], cur->ne[3]);
+
+    return ggml_map_custom2_inplace(ctx0, out, cur, ggml_sam_sincos, GGML_N_TASKS_MAX, NULL);
+}
+
+// quantize the neck output src [C, W, H] into the int8 image embedding dst with one scale per channel, stored in
+// scale [C]. every thread handles a range of channels and streams over the pixels twice: absmax, then quantize
+static void ggml_sam_quantize_embd(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * src, const struct ggml_tensor * scale, int ith, int nth, void * userdata) {
     GGML_ASSERT(userdata == NULL);
-    GGML_ASSERT(ggml_are_same_shape(dst, src));
+    GGML_ASSERT(dst->type == GGML_TYPE_I8 && src->type == GGML_TYPE_F32 && scale->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_is_contiguous(dst));
+    GGML_ASSERT(ggml_is_contiguous(src));
+    GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src) && dst->ne[0] == src->ne[0]);
+    GGML_ASSERT(ggml_nelements(scale) == src->ne[0]);
+
+    (void) a;
+
+    const int n_ch = (int)src->ne[0];
+    const int n_px = (int)(ggml_nelements(src)/n_ch);
+    const int dc   = (n_ch + nth - 1) / nth;
+    const int ic0  = dc * ith;
+    const int ic1  = std::min(ic0 + dc, n_ch);
+
+    if (ic0 >= ic1) {
+        return;
+    }
+
+    const float * x = (const float *) src->data;
+         int8_t * y = (     int8_t *) dst->data;
+          float * d = (      float *) scale->data;
+
+    std::vector<float> amax(ic1 - ic0, 0.0f);
+
+    for (int p = 0; p < n_px; ++p) {
+        for (int ic = ic0; ic < ic1; ++ic) {
+            amax[ic - ic0] = std::max(amax[ic - ic0], fabsf(x[p*n_ch + ic]));
+        }
+    }
+
+    std::vector<float> id(ic1 - ic0);
+    for (int ic = ic0; ic < ic1; ++ic) {
+        d[ic] = amax[ic - ic0]/127.0f;
+        id[ic - ic0] = amax[ic - ic0] > 0.0f ? 127.0f/amax[ic - ic0] : 0.0f;
+    }
+
+    for (int p = 0; p < n_px; ++p) {
+        for (int ic = ic0; ic < ic1; ++ic) {
+            y[p*n_ch + ic] = (int8_t) roundf(x[p*n_ch + ic]*id[ic - ic0]);
+        }
+    }
+}
+
+// dequantize the int8 image embedding src [C, W*H] with the per-channel scale [C] into dst
+static void ggml_sam_dequantize_embd(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * src, const struct ggml_tensor * scale, int ith, int nth, void * userdata) {
+    GGML_ASSERT(userdata == NULL);
+    GGML_ASSERT(dst->type == GGML_TYPE_F32 && src->type == GGML_TYPE_I8 && scale->type == GGML_TYPE_F32);
     GGML_ASSERT(ggml_is_contiguous(dst));
     GGML_ASSERT(ggml_is_contiguous(src));
+    GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src));
+    GGML_ASSERT(ggml_nelements(scale) == src->ne[0]);
+
+    (void) a;
+
+    const int n_ch = (int)src->ne[0];
+    const int nr   = (int)(ggml_nelements(src)/n_ch);
+    const int dr   = (nr + nth - 1) / nth;
+    const int ir0  = dr * ith;
+    const int ir1  = std::min(ir0 + dr, nr);
+
+    const float * d = (const float *) scale->data;
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const int8_t * x = (const int8_t *) src->data + ir*n_ch;
+              float  * y = (      float  *) dst->data + ir*n_ch;
+
+        for (int ic = 0; ic < n_ch; ++ic) {
+            y[ic] = x[ic]*d[ic];
+        }
+    }
+}
+
+// gelu with the same tanh approximation as ggml_gelu. tanh is evaluated with its [7/6] Pade approximant
+// (clamped, max abs error ~1e-4), so the loops calling this are vectorized by the compiler
+static inline float sam_gelu(float v) {
+    const float sqrt_2_over_pi = 0.79788456080286535587989211986876f;
+    const float gelu_coef_a    = 0.044715f;
+
+    float u = sqrt_2_over_pi*v*(1.0f + gelu_coef_a*v*v);
+    u = std::min(std::max(u, -4.97f), 4.97f);
+
+    const float u2 = u*u;
+    const float t  = u*(135135.0f + u2*(17325.0f + u2*(378.0f + u2)))/(135135.0f + u2*(62370.0f + u2*(3150.0f + 28.0f*u2)));
+
+    return 0.5f*v*(1.0f + t);
+}
+
+// dst = gelu(a + b) with b broadcast over the rows of a - the bias and activation epilogue of the encoder mlp_lin1
+static void ggml_sam_bias_gelu(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata) {
+    GGML_ASSERT(userdata == NULL);
+    GGML_ASSERT(ggml_are_same_shape(dst, a));
+    GGML_ASSERT(ggml_is_contiguous(dst) && ggml_is_contiguous(a));
+    GGML_ASSERT(a->type == GGML_TYPE_F32 && b->type == GGML_TYPE_F32 && ggml_nelements(b) == a->ne[0]);
+
+    const int nc = (int)a->ne[0];
+    const int nr = (int)ggml_nrows(a);
+    const int dr = (nr + nth - 1) / nth;
+    const int ir0 = dr * ith;
+    const int ir1 = std::min(ir0 + dr, nr);
+
+    const float * bias = (const float *) b->data;
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const float * x = (const float *) ((const char *) a->data   + ir*a->nb[1]);
+              float * y = (      float *) ((      char *) dst->data + ir*dst->nb[1]);
+
+        for (int i = 0; i < nc; ++i) {
+            y[i] = sam_gelu(x[i] + bias[i]);
+        }
+    }
+}
+
+// epilogue of the stride-2 kernel-2 transposed convolution, see sam_conv_transpose_2d_k2s2
+// scatters every row of src [(C, kx, ky), W, H, B] into its 2x2 output block of dst [C, 2W, 2H, B] (same memory
+// size as src), adds the bias and optionally applies a LayerNorm2d (ln_wb = [weight | bias], eps) and the GELU
+static void sam_upscale_epilogue(
+        struct ggml_tensor * dst,
+        const struct ggml_tensor * src,
+        const struct ggml_tensor * bias,
+        const struct ggml_tensor * ln_wb,
+        float eps,
+        int ith,
+        int nth) {
+    GGML_ASSERT(ggml_are_same_shape(dst, src));
+    GGML_ASSERT(ggml_is_contiguous(dst) && ggml_is_contiguous(src));
+    GGML_ASSERT(src->type == GGML_TYPE_F32 && bias->type == GGML_TYPE_F32);
+
+    const int nc = (int)(src->ne[0]/4);
+    const int W  = (int)src->ne[1];
+    const int nr = (int)(src->ne[2]*src->ne[3]); // input rows (y, b)
+
+    GGML_ASSERT(ggml_nelements(bias) == nc);
+    GGML_ASSERT(!ln_wb || (ln_wb->type == GGML_TYPE_F32 && ggml_nelements(ln_wb) == 2*nc));
+
+    const int dr = (nr + nth - 1) / nth;
+    const int ir0 = dr * ith;
+    const int ir1 = std::min(ir0 + dr, nr);
+
+    const float * b_data  = (const float *) bias->data;
+    const float * ln_w    = ln_wb ? (const float *) ln_wb->data      : nullptr;
+    const float * ln_b    = ln_wb ? (const float *) ln_wb->data + nc : nullptr;
+
+    std::vector<float> v(nc);
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        for (int x = 0; x < W; ++x) {
+            const float * s = (const float *) src->data + ((int64_t) ir*W + x)*4*nc;
 
-    const float * src_data = ggml_get_data_f32(src);
-    float * dst_data = ggml_get_data_f32(dst);
+            for (int k = 0; k < 4; ++k) {
+                const int kx = k % 2;
+                const int ky = k / 2;
 
-    const int ne = (int)ggml_nelements(dst);
-    const int dr = (ne + nth - 1) / nth;
-    const int ie0 = dr * ith;
-    const int ie1 = std::min(ie0 + dr, ne);
+                // output row 2*y + ky of the same batch entry, column 2*x + kx
+                float * d = (float *) dst->data + (((int64_t) 2*ir + ky)*2*W + 2*x + kx)*nc;
 
-    for (int i = ie0; i < ie1; ++i) {
-        dst_data[i] = cosf(src_data[i]);
+                for (int i = 0; i < nc; ++i) {
+                    v[i] = s[k*nc + i] + b_data[i];
+                }
+
+                if (ln_wb) {
+                    float mean = 0.0f;
+                    for (int i = 0; i < nc; ++i) {
+                        mean += v[i];
+                    }
+                    mean /= nc;
+
+                    float var = 0.0f;
+                    for (int i = 0; i < nc; ++i) {
+                        v[i] -= mean;
+                        var  += v[i]*v[i];
+                    }
+
+                    const float rstd = 1.0f/sqrtf(var/nc + eps);
+                    for (int i = 0; i < nc; ++i) {
+                        v[i] = v[i]*rstd*ln_w[i] + ln_b[i];
+                    }
+                }
+
+                for (int i = 0; i < nc; ++i) {
+                    d[i] = sam_gelu(v[i]);
+                }
+            }
+        }
+    }
+}
+
+static void ggml_sam_upscale_gelu(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata) {
+    GGML_ASSERT(userdata == NULL);
+
+    sam_upscale_epilogue(dst, a, b, nullptr, 0.0f, ith, nth);
+}
+
+// userdata points to the float eps
+static void ggml_sam_upscale_norm_gelu(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, const struct ggml_tensor * c, int ith, int nth, void * userdata) {
+    GGML_ASSERT(userdata != NULL);
+
+    sam_upscale_epilogue(dst, a, b, c, *(const float *) userdata, ith, nth);
+}
+
+// dst = a + b + c with b broadcast over the rows of a - the bias and residual epilogue of the encoder projections
+// and of the patch embedding
+static void ggml_sam_bias_residual(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, const struct ggml_tensor * c, int ith, int nth, void * userdata) {
+    GGML_ASSERT(userdata == NULL);
+    GGML_ASSERT(ggml_are_same_shape(dst, a) && ggml_are_same_shape(a, c));
+    GGML_ASSERT(ggml_is_contiguous(dst) && ggml_is_contiguous(a) && ggml_is_contiguous(c));
+    GGML_ASSERT(a->type == GGML_TYPE_F32 && b->type == GGML_TYPE_F32 && c->type == GGML_TYPE_F32 && ggml_nelements(b) == a->ne[0]);
+
+    const int nc = (int)a->ne[0];
+    const int nr = (int)ggml_nrows(a);
+    const int dr = (nr + nth - 1) / nth;
+    const int ir0 = dr * ith;
+    const int ir1 = std::min(ir0 + dr, nr);
+
+    const float * bias = (const float *) b->data;
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const float * x = (const float *) ((const char *) a->data   + ir*a->nb[1]);
+        const float * r = (const float *) ((const char *) c->data   + ir*c->nb[1]);
+              float * y = (      float *) ((      char *) dst->data + ir*dst->nb[1]);
+
+        for (int i = 0; i < nc; ++i) {
+            y[i] = x[i] + bias[i] + r[i];
+        }
     }
 }
 
@@ -352,10 +728,39 @@ static void ggml_sam_cos(struct ggml_tensor * dst , const struct ggml_tensor * s
 //     TODO: why are these hardcoded !?
 // pad to 1024x1024
 // TODO: for some reason, this is not numerically identical to pytorch's interpolation
-bool sam_image_preprocess(const sam_image_u8 & img, sam_image_f32 & res) {
+static int sam_pixel_format_bpp(sam_pixel_format format) {
+    switch (format) {
+        case SAM_PIXEL_FORMAT_RGB:
+        case SAM_PIXEL_FORMAT_BGR:  return 3;
+        case SAM_PIXEL_FORMAT_RGBA:
+        case SAM_PIXEL_FORMAT_BGRA: return 4;
+    }
+    return 0;
+}
+
+// resize + normalize directly from the caller's buffer
+bool sam_image_preprocess(const sam_image_view & img, sam_image_f32 & res) {
     const int nx = img.nx;
     const int ny = img.ny;
 
+    const int bpp = sam_pixel_format_bpp(img.format);
+
+    if (!img.data || nx <= 0 || ny <= 0 || bpp == 0) {
+        fprintf(stderr, "%s: invalid image view\n", __func__);
+        return false;
+    }
+
+    if (img.stride != 0 && img.stride < bpp*nx) {
+        fprintf(stderr, "%s: row stride %d is smaller than the row size %d\n", __func__, img.stride, bpp*nx);
+        return false;
+    }
+
+    const size_t stride = img.stride != 0 ? (size_t) img.stride : (size_t) bpp*nx;
+
+    // offsets of the R, G and B bytes in a pixel
+    const bool is_bgr = img.format == SAM_PIXEL_FORMAT_BGR || img.format == SAM_PIXEL_FORMAT_BGRA;
+    const int coff[3] = { is_bgr ? 2 : 0, 1, is_bgr ? 0 : 2 };
+
     const int nx2 = 1024;
     const int ny2 = 1024;
 
@@ -374,30 +779,30 @@ bool sam_image_preprocess(const sam_image_u8 & img, sam_image_f32 & res) {
     const float s3[3] = {  58.395f,  57.120f,  57.375f };
 
     for (int y = 0; y < ny3; y++) {
-        for (int x = 0; x < nx3; x++) {
-            for (int c = 0; c < 3; c++) {
-                // linear interpolation
-                const float sx = (x + 0.5f)*scale - 0.5f;
-                const float sy = (y + 0.5f)*scale - 0.5f;
+        // linear interpolation
+        const float sy = (y + 0.5f)*scale - 0.5f;
+
+        const int y0 = std::max(0, (int) std::floor(sy));
+        const int y1 = std::min(y0 + 1, ny - 1);
 
-                const int x0 = std::max(0, (int) std::floor(sx));
-                const int y0 = std::max(0, (int) std::floor(sy));
+        const float dy = sy - y0;
 
-                const int x1 = std::min(x0 + 1, nx - 1);
-                const int y1 = std::min(y0 + 1, ny - 1);
+        const uint8_t * row0 = img.data + y0*stride;
+        const uint8_t * row1 = img.data + y1*stride;
 
-                const float dx = sx - x0;
-                const float dy = sy - y0;
+        for (int x = 0; x < nx3; x++) {
+            const float sx = (x + 0.5f)*scale - 0.5f;
+
+            const int x0 = std::max(0, (int) std::floor(sx));
+            const int x1 = std::min(x0 + 1, nx - 1);
 
-                const int j00 = 3*(y0*nx + x0) + c;
-                const int j01 = 3*(y0*nx + x1) + c;
-                const int j10 = 3*(y1*nx + x0) + c;
-                const int j11 = 3*(y1*nx + x1) + c;
+            const float dx = sx - x0;
 
-                const float v00 = img.data[j00];
-                const float v01 = img.data[j01];
-                const float v10 = img.data[j10];
-                const float v11 = img.data[j11];
+            for (int c = 0; c < 3; c++) {
+                const float v00 = row0[bpp*x0 + coff[c]];
+                const float v01 = row0[bpp*x1 + coff[c]];
+                const float v10 = row1[bpp*x0 + coff[c]];
+                const float v11 = row1[bpp*x1 + coff[c]];
 
                 const float v0 = v00*(1.0f - dx) + v01*dx;
                 const float v1 = v10*(1.0f - dx) + v11*dx;
@@ -416,6 +821,149 @@ bool sam_image_preprocess(const sam_image_u8 & img, sam_image_f32 & res) {
     return true;
 }
 
+static sam_image_view sam_image_view_from_u8(const sam_image_u8 & img) {
+    sam_image_view view;
+    view.data   = img.data.data();
+    view.nx     = img.nx;
+    view.ny     = img.ny;
+    view.stride = 3*img.nx;
+    view.format = SAM_PIXEL_FORMAT_RGB;
+
+    return view;
+}
+
+bool sam_image_preprocess(const sam_image_u8 & img, sam_image_f32 & res) {
+    return sam_image_preprocess(sam_image_view_from_u8(img), res);
+}
+
+// fold the affine of a LayerNorm into the linear layer (w, b) that follows it:
+//   w*(g*x + beta) + b = (w*diag(g))*x + (w*beta + b)
+static void sam_fold_norm_affine(const struct ggml_tensor * g, const struct ggml_tensor * beta, struct ggml_tensor * w, struct ggml_tensor * b) {
+    GGML_ASSERT(w->type == GGML_TYPE_F16);
+    GGML_ASSERT(g->type == GGML_TYPE_F32 && beta->type == GGML_TYPE_F32 && b->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_nelements(g) == w->ne[0] && ggml_nelements(beta) == w->ne[0] && ggml_nelements(b) == w->ne[1]);
+
+    const int n_in  = (int) w->ne[0];
+    const int n_out = (int) w->ne[1];
+
+    const float * g_data    = (const float *) g->data;
+    const float * beta_data = (const float *) beta->data;
+          float * b_data    = (      float *) b->data;
+
+    std::vector<float> row(n_in);
+
+    for (int o = 0; o < n_out; ++o) {
+        ggml_fp16_t * w_row = (ggml_fp16_t *) ((char *) w->data + o*w->nb[1]);
+
+        ggml_fp16_to_fp32_row(w_row, row.data(), n_in);
+
+        double sum = 0.0;
+        for (int i = 0; i < n_in; ++i) {
+            sum    += (double) row[i]*beta_data[i];
+            row[i] *= g_data[i];
+        }
+
+        ggml_fp32_to_fp16_row(row.data(), w_row, n_in);
+
+        b_data[o] += (float) sum;
+    }
+}
+
+// fold the value bias of an attention layer into the bias of its output projection. every row of the softmax sums
+// to 1, so the bias of the values passes through the attention unchanged:
+//   proj_w*(softmax*(V + bv)) + proj_b = proj_w*(softmax*V) + (proj_w*bv + proj_b)
+// the value bias (the last third of qkv_b) is set to zero
+static void sam_fold_v_bias(struct ggml_tensor * qkv_b, const struct ggml_tensor * proj_w, struct ggml_tensor * proj_b) {
+    GGML_ASSERT(proj_w->type == GGML_TYPE_F16);
+    GGML_ASSERT(qkv_b->type == GGML_TYPE_F32 && proj_b->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_nelements(qkv_b) == 3*proj_w->ne[0] && ggml_nelements(proj_b) == proj_w->ne[1]);
+
+    const int n_in  = (int) proj_w->ne[0];
+    const int n_out = (int) proj_w->ne[1];
+
+    float * bv_data     = (float *) qkv_b->data + 2*n_in;
+    float * proj_b_data = (float *) proj_b->data;
+
+    std::vector<float> row(n_in);
+
+    for (int o = 0; o < n_out; ++o) {
+        ggml_fp16_to_fp32_row((const ggml_fp16_t *) ((const char *) proj_w->data + o*proj_w->nb[1]), row.data(), n_in);
+
+        double sum = 0.0;
+        for (int i = 0; i < n_in; ++i) {
+            sum += (double) row[i]*bv_data[i];
+        }
+
+        proj_b_data[o] += (float) sum;
+    }
+
+    std::fill(bv_data, bv_data + n_in, 0.0f);
+}
+
+// reorder the [3, 3, C_in, C_out] kernel of a 3x3 convolution into 9 contiguous [C_in, C_out] matrices, one per
+// tap (kx + 3*ky)
+static void sam_conv_3x3_taps(const struct ggml_tensor * src, struct ggml_tensor * dst) {
+    GGML_ASSERT(src->type == GGML_TYPE_F16 && dst->type == GGML_TYPE_F16);
+    GGML_ASSERT(src->ne[0] == 3 && src->ne[1] == 3);
+    GGML_ASSERT(dst->ne[0] == src->ne[2] && dst->ne[1] == src->ne[3] && dst->ne[2] == 9);
+
+    const int64_t n_in  = src->ne[2];
+    const int64_t n_out = src->ne[3];
+
+    const ggml_fp16_t * w = (const ggml_fp16_t *) src->data;
+          ggml_fp16_t * t = (      ggml_fp16_t *) dst->data;
+
+    for (int64_t it = 0; it < 9; ++it) {
+        for (int64_t io = 0; io < n_out; ++io) {
+            for (int64_t ii = 0; ii < n_in; ++ii) {
+                t[(it*n_out + io)*n_in + ii] = w[(io*n_in + ii)*9 + it];
+            }
+        }
+    }
+}
+
+// reorder the [2, 2, C_out, C_in] kernel of a stride-2 transposed convolution into [C_in, (C_out, kx, ky)], so that
+// the convolution is one matmul producing the 2x2 output block of every input pixel in a row
+static void sam_conv_transpose_k2s2_weights(const struct ggml_tensor * src, struct ggml_tensor * dst) {
+    GGML_ASSERT(src->type == GGML_TYPE_F16 && dst->type == GGML_TYPE_F16);
+    GGML_ASSERT(src->ne[0] == 2 && src->ne[1] == 2);
+    GGML_ASSERT(dst->ne[0] == src->ne[3] && dst->ne[1] == 4*src->ne[2]);
+
+    const int64_t n_out = src->ne[2];
+    const int64_t n_in  = src->ne[3];
+
+    const ggml_fp16_t * w = (const ggml_fp16_t *) src->data;
+          ggml_fp16_t * t = (      ggml_fp16_t *) dst->data;
+
+    for (int64_t k = 0; k < 4; ++k) {
+        for (int64_t io = 0; io < n_out; ++io) {
+            for (int64_t ii = 0; ii < n_in; ++ii) {
+                t[(k*n_out + io)*n_in + ii] = w[(ii*n_out + io)*4 + k];
+            }
+        }
+    }
+}
+
+// same as ggml_get_rel_pos(src, n, n) with n = dst->ne[1]: row k of slice q of dst is row (n - k - 1) + q of src
+// ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L292-L322
+static void sam_rel_pos_gather(const struct ggml_tensor * src, struct ggml_tensor * dst) {
+    GGML_ASSERT(src->type == dst->type);
+    GGML_ASSERT(src->ne[0] == dst->ne[0] && dst->ne[1] == dst->ne[2] && src->ne[1] == 2*dst->ne[1] - 1);
+
+    const int64_t n = dst->ne[1];
+
+    for (int64_t q = 0; q < n; ++q) {
+        for (int64_t k = 0; k < n; ++k) {
+            memcpy((char *) dst->data + q*dst->nb[2] + k*dst->nb[1], (const char *) src->data + ((n - k - 1) + q)*src->nb[1], src->nb[1]);
+        }
+    }
+}
+
+// slice i along dim 2 of a stacked tensor, as a 2D view
+static struct ggml_tensor * sam_slice(struct ggml_context * ctx, struct ggml_tensor * t, int i) {
+    return ggml_view_2d(ctx, t, t->ne[0], t->ne[1], t->nb[1], i*t->nb[2]);
+}
+
 bool sam_ggml_model_load(const std::string & fname, sam_ggml_model & model) {
     fprintf(stderr, "%s: loading model from '%s' - please wait ...\n", __func__, fname.c_str());
 
@@ -497,6 +1045,7 @@ bool sam_ggml_model_load(const std::string & fname, sam_ggml_model & model) {
 
             buf_size +=     n_enc_state*n_enc_out_chans*1*1*ggml_type_sizef(GGML_TYPE_F16);
             buf_size += n_enc_out_chans*n_enc_out_chans*3*3*ggml_type_sizef(GGML_TYPE_F16);
+            buf_size += n_enc_out_chans*n_enc_out_chans*3*3*ggml_type_sizef(GGML_TYPE_F16); // neck_conv_1_taps
 
             buf_size += n_enc_out_chans*ggml_type_sizef(GGML_TYPE_F32);
             buf_size += n_enc_out_chans*ggml_type_sizef(GGML_TYPE_F32);
@@ -530,9 +1079,16 @@ bool sam_ggml_model_load(const std::string & fname, sam_ggml_model & model) {
 
             buf_size += n_enc_layer*4*n_enc_state*n_enc_state*ggml_type_sizef(GGML_TYPE_F16);
             buf_size += n_enc_layer*4*n_enc_state*            ggml_type_sizef(GGML_TYPE_F32);
+
+            // gathered relative position tables
+            for (int i = 0; i < n_enc_layer; ++i) {
+                const int32_t n_attn = hparams.is_global_attn(i) ? n_img_embd : n_window_size;
+
+                buf_size += 2*n_enc_head_dim*n_attn*n_attn*ggml_type_sizef(GGML_TYPE_F16);
+            }
         }
 
-        buf_size += (8 + 14*n_enc_layer)*ggml_tensor_overhead();
+        buf_size += (9 + 16*n_enc_layer)*ggml_tensor_overhead();
 
         // prompt encoder
         {
@@ -540,9 +1096,12 @@ bool sam_ggml_model_load(const std::string & fname, sam_ggml_model & model) {
 
             buf_size += n_enc_out_chans*ggml_type_sizef(GGML_TYPE_F32);
             buf_size += n_pt_embd*n_enc_out_chans*ggml_type_sizef(GGML_TYPE_F32);
+
+            // mask_downscaling
+            buf_size += (4*4 + 3*4 + 16*4*4 + 3*16 + n_enc_out_chans*16 + n_enc_out_chans)*ggml_type_sizef(GGML_TYPE_F32);
         }
 
-        buf_size += (2 + n_pt_embd)*ggml_tensor_overhead();
+        buf_size += (2 + n_pt_embd + 10)*ggml_tensor_overhead();
 
         // mask decoder
         {
@@ -593,12 +1152,21 @@ bool sam_ggml_model_load(const std::string & fname, sam_ggml_model & model) {
                 buf_size += n_enc_out_chans*n_img_embd*(n_img_embd/2)*2*2*ggml_type_sizef(GGML_TYPE_F16);
                 buf_size += (n_img_embd/2)*                               ggml_type_sizef(GGML_TYPE_F32);
 
+                // output_upscaling, prepared at load time
+                buf_size += n_enc_out_chans*n_img_embd*2*2*ggml_type_sizef(GGML_TYPE_F16);
+                buf_size += n_img_embd*(n_img_embd/2)*2*2*ggml_type_sizef(GGML_TYPE_F16);
+                buf_size += 2*n_img_embd*ggml_type_sizef(GGML_TYPE_F32);
+                buf_size += 3*ggml_tensor_overhead();
+
                 // output_hypernetworks_mlps
                 buf_size += n_hypernet_mpls_count*2*n_enc_out_chans*n_enc_out_chans*ggml_type_sizef(GGML_TYPE_F16);
                 buf_size += n_hypernet_mpls_count*2*n_enc_out_chans*                ggml_type_sizef(GGML_TYPE_F32);
                 buf_size += n_hypernet_mpls_count*n_enc_out_chans*(n_img_embd/2)*ggml_type_sizef(GGML_TYPE_F16);
                 buf_size += n_hypernet_mpls_count*(n_img_embd/2)*                ggml_type_sizef(GGML_TYPE_F32);
 
+                // output_hypernetworks_mlps, stacked - the tensors of the single MLPs are views into these
+                buf_size += 6*ggml_tensor_overhead();
+
                 // iou_prediction_head
                 buf_size += 2*n_enc_out_chans*n_enc_out_chans*ggml_type_sizef(GGML_TYPE_F16);
                 buf_size += 2*n_enc_out_chans*                ggml_type_sizef(GGML_TYPE_F32);
@@ -674,6 +1242,8 @@ bool sam_ggml_model_load(const std::string & fname, sam_ggml_model & model) {
             enc.neck_conv_0 = ggml_new_tensor_4d(ctx, GGML_TYPE_F16, 1, 1, n_enc_state,     n_enc_out_chans);
             enc.neck_conv_1 = ggml_new_tensor_4d(ctx, GGML_TYPE_F16, 3, 3, n_enc_out_chans, n_enc_out_chans);
 
+            enc.neck_conv_1_taps = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, n_enc_out_chans, n_enc_out_chans, 3*3);
+
             enc.neck_norm_0_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_enc_out_chans);
             enc.neck_norm_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_enc_out_chans);
 
@@ -708,6 +1278,13 @@ bool sam_ggml_model_load(const std::string & fname, sam_ggml_model & model) {
                     layer.rel_pos_h = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_enc_head_dim, 2*n_window_size - 1);
                 }
 
+                {
+                    const int32_t n_attn = hparams.is_global_attn(i) ? n_img_embd : n_window_size;
+
+                    layer.rel_pos_w_tab = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, n_enc_head_dim, n_attn, n_attn);
+                    layer.rel_pos_h_tab = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, n_enc_head_dim, n_attn, n_attn);
+                }
+
                 layer.qkv_w = ggml_new_tensor_2d(ctx, GGML_TYPE_F16,   n_enc_state, 3*n_enc_state);
                 layer.qkv_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 3*n_enc_state);
 
@@ -765,6 +1342,34 @@ bool sam_ggml_model_load(const std::string & fname, sam_ggml_model & model) {
 
                 model.tensors["prompt_encoder.point_embeddings." + std::to_string(i) + ".weight"] = enc.pt_embd[i];
             }
+
+            enc.mask_down_0_w = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, 2, 2, 1, 4);
+            enc.mask_down_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4);
+            enc.mask_down_1_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4);
+            enc.mask_down_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4);
+            enc.mask_down_3_w = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, 2, 2, 4, 16);
+            enc.mask_down_3_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 16);
+            enc.mask_down_4_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 16);
+            enc.mask_down_4_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 16);
+            enc.mask_down_6_w = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, 1, 1, 16, n_enc_out_chans);
+            enc.mask_down_6_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_enc_out_chans);
+
+            model.tensors["prompt_encoder.mask_downscaling.0.weight"] = enc.mask_down_0_w;
+            model.tensors["prompt_encoder.mask_downscaling.0.bias"]   = enc.mask_down_0_b;
+            model.tensors["prompt_encoder.mask_downscaling.1.weight"] = enc.mask_down_1_w;
+            model.tensors["prompt_encoder.mask_downscaling.1.bias"]   = enc.mask_down_1_b;
+            model.tensors["prompt_encoder.mask_downscaling.3.weight"] = enc.mask_down_3_w;
+            model.tensors["prompt_encoder.mask_downscaling.3.bias"]   = enc.mask_down_3_b;
+            model.tensors["prompt_encoder.mask_downscaling.4.weight"] = enc.mask_down_4_w;
+            model.tensors["prompt_encoder.mask_downscaling.4.bias"]   = enc.mask_down_4_b;
+            model.tensors["prompt_encoder.mask_downscaling.6.weight"] = enc.mask_down_6_w;
+            model.tensors["prompt_encoder.mask_downscaling.6.bias"]   = enc.mask_down_6_b;
+
+            for (const auto & it : model.tensors) {
+                if (it.first.find("prompt_encoder.mask_downscaling.") == 0) {
+                    model.tensors_optional.insert(it.first);
+                }
+            }
         }
 
         // mask decoder
@@ -896,6 +1501,10 @@ bool sam_ggml_model_load(const std::string & fname, sam_ggml_model & model) {
             dec.output_upscaling_3_w = ggml_new_tensor_4d(ctx, GGML_TYPE_F16,  2, 2, n_img_embd/2, n_img_embd);
             dec.output_upscaling_3_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_img_embd/2);
 
+            dec.output_upscaling_0_w_t = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_enc_out_chans, 4*n_img_embd);
+            dec.output_upscaling_3_w_t = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_img_embd,      4*(n_img_embd/2));
+            dec.output_upscaling_1_wb  = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 2*n_img_embd);
+
             model.tensors["mask_decoder.output_upscaling.0.weight"] = dec.output_upscaling_0_w;
             model.tensors["mask_decoder.output_upscaling.0.bias"]   = dec.output_upscaling_0_b;
             model.tensors["mask_decoder.output_upscaling.1.weight"] = dec.output_upscaling_1_w;
@@ -904,16 +1513,24 @@ bool sam_ggml_model_load(const std::string & fname, sam_ggml_model & model) {
             model.tensors["mask_decoder.output_upscaling.3.bias"]   = dec.output_upscaling_3_b;
 
             const int n_hypernet_mpls_count = 4;
+
+            dec.output_hypernet_w_0 = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, n_enc_out_chans, n_enc_out_chans, n_hypernet_mpls_count);
+            dec.output_hypernet_b_0 = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_enc_out_chans, 1,               n_hypernet_mpls_count);
+            dec.output_hypernet_w_1 = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, n_enc_out_chans, n_enc_out_chans, n_hypernet_mpls_count);
+            dec.output_hypernet_b_1 = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_enc_out_chans, 1,               n_hypernet_mpls_count);
+            dec.output_hypernet_w_2 = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, n_enc_out_chans, n_img_embd/2,    n_hypernet_mpls_count);
+            dec.output_hypernet_b_2 = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_img_embd/2,    1,               n_hypernet_mpls_count);
+
             dec.output_hypernet_mlps.resize(n_hypernet_mpls_count);
             for (int i = 0; i < n_hypernet_mpls_count; ++i) {
                 auto& mlp = dec.output_hypernet_mlps[i];
 
-                mlp.w_0 = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_enc_out_chans, n_enc_out_chans);
-                mlp.b_0 = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_enc_out_chans);
-                mlp.w_1 = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_enc_out_chans, n_enc_out_chans);
-                mlp.b_1 = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_enc_out_chans);
-                mlp.w_2 = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_enc_out_chans, n_img_embd/2);
-                mlp.b_2 = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_img_embd/2);
+                mlp.w_0 = sam_slice(ctx, dec.output_hypernet_w_0, i);
+                mlp.b_0 = sam_slice(ctx, dec.output_hypernet_b_0, i);
+                mlp.w_1 = sam_slice(ctx, dec.output_hypernet_w_1, i);
+                mlp.b_1 = sam_slice(ctx, dec.output_hypernet_b_1, i);
+                mlp.w_2 = sam_slice(ctx, dec.output_hypernet_w_2, i);
+                mlp.b_2 = sam_slice(ctx, dec.output_hypernet_b_2, i);
 
                 const auto prefix = "mask_decoder.output_hypernetworks_mlps." + std::to_string(i) + ".";
                 model.tensors[prefix + "layers.0.weight"] = mlp.w_0;
@@ -1023,7 +1640,15 @@ bool sam_ggml_model_load(const std::string & fname, sam_ggml_model & model) {
                 return false;
             }
 
-            ggml_allocr_alloc(alloc, tensor);
+            if (tensor->view_src != NULL) {
+                // a slice of a stacked tensor - allocate the whole stack on its first slice
+                if (tensor->view_src->data == NULL) {
+                    ggml_allocr_alloc(alloc, tensor->view_src);
+                }
+                tensor->data = (char *) tensor->view_src->data + tensor->view_offs;
+            } else {
+                ggml_allocr_alloc(alloc, tensor);
+            }
             fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
 
             total_size += ggml_nbytes(tensor);
@@ -1033,11 +1658,64 @@ bool sam_ggml_model_load(const std::string & fname, sam_ggml_model & model) {
             }
         }
 
-        if (n_tensors != model.tensors.size()) {
-            fprintf(stderr, "%s: model file has %d tensors, but %d tensors were expected\n", __func__, n_tensors, (int) model.tensors.size());
+        int n_tensors_missing_optional = 0;
+        for (const auto & name : model.tensors_optional) {
+            if (!model.tensors[name]->data) {
+                n_tensors_missing_optional++;
+            }
+        }
+
+        if (n_tensors + n_tensors_missing_optional != (int) model.tensors.size()) {
+            fprintf(stderr, "%s: model file has %d tensors, but %d tensors were expected\n", __func__, n_tensors, (int) model.tensors.size() - n_tensors_missing_optional);
             return false;
         }
 
+        // the mask prompt can only be used if all of its tensors were loaded
+        model.enc_prompt.has_mask_down = n_tensors_missing_optional == 0;
+        if (!model.enc_prompt.has_mask_down) {
+            fprintf(stderr, "%s: model file has no mask_downscaling tensors - mask prompts are disabled\n", __func__);
+        }
+
+        // fold the LayerNorm affines that are directly followed by a linear layer into its weights
+        for (int i = 0; i < (int) model.enc_img.layers.size(); ++i) {
+            auto & layer = model.enc_img.layers[i];
+
+            if (model.hparams.is_global_attn(i)) {
+                sam_fold_norm_affine(layer.norm1_w, layer.norm1_b, layer.qkv_w, layer.qkv_b);
+            }
+
+            sam_fold_norm_affine(layer.norm2_w, layer.norm2_b, layer.mlp_lin1_w, layer.mlp_lin1_b);
+
+            sam_fold_v_bias(layer.qkv_b, layer.proj_w, layer.proj_b);
+        }
+
+        // the gathered relative position tables only depend on the weights and on the attention size of the
+        // layer, so they are computed here instead of on every encoder run
+        for (auto & layer : model.enc_img.layers) {
+            ggml_allocr_alloc(alloc, layer.rel_pos_w_tab);
+            ggml_allocr_alloc(alloc, layer.rel_pos_h_tab);
+
+            sam_rel_pos_gather(layer.rel_pos_w, layer.rel_pos_w_tab);
+            sam_rel_pos_gather(layer.rel_pos_h, layer.rel_pos_h_tab);
+        }
+
+        ggml_allocr_alloc(alloc, model.enc_img.neck_conv_1_taps);
+        sam_conv_3x3_taps(model.enc_img.neck_conv_1, model.enc_img.neck_conv_1_taps);
+
+        {
+            auto & dec = model.dec;
+
+            ggml_allocr_alloc(alloc, dec.output_upscaling_0_w_t);
+            ggml_allocr_alloc(alloc, dec.output_upscaling_3_w_t);
+            ggml_allocr_alloc(alloc, dec.output_upscaling_1_wb);
+
+            sam_conv_transpose_k2s2_weights(dec.output_upscaling_0_w, dec.output_upscaling_0_w_t);
+            sam_conv_transpose_k2s2_weights(dec.output_upscaling_3_w, dec.output_upscaling_3_w_t);
+
+            memcpy((char *) dec.output_upscaling_1_wb->data, dec.output_upscaling_1_w->data, ggml_nbytes(dec.output_upscaling_1_w));
+            memcpy((char *) dec.output_upscaling_1_wb->data + ggml_nbytes(dec.output_upscaling_1_w), dec.output_upscaling_1_b->data, ggml_nbytes(dec.output_upscaling_1_b));
+        }
+
         fprintf(stderr, " done\n");
 
         fprintf(stderr, "%s: model size = %8.2f MB / num tensors = %d\n", __func__, total_size/1024.0/1024.0, n_tensors);
@@ -1079,58 +1757,88 @@ struct ggml_tensor * sam_fill_dense_pe(
 
     struct ggml_tensor * cur = ggml_mul_mat(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, enc.pe)), xy_embed_stacked);
 
-    cur = ggml_scale(ctx0, cur, ggml_new_f32(ctx0, float(2.0f*M_PI)));
-
-    // concat
+    // scale by 2*pi, sin, cos and concat in a single op
     // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L192
-    {
-        struct ggml_tensor * t_sin = ggml_map_custom1(ctx0, cur, ggml_sam_sin, GGML_N_TASKS_MAX, NULL);
-        struct ggml_tensor * t_cos = ggml_map_custom1(ctx0, cur, ggml_sam_cos, GGML_N_TASKS_MAX, NULL);
-
-        cur = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, t_sin->ne[0] + t_cos->ne[0], cur->ne[1], cur->ne[2]);
-
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, t_sin, ggml_view_3d(ctx0, cur, t_sin->ne[0], t_sin->ne[1], t_sin->ne[2], cur->nb[1], cur->nb[2], 0)));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, t_cos, ggml_view_3d(ctx0, cur, t_sin->ne[0], t_sin->ne[1], t_sin->ne[2], cur->nb[1], cur->nb[2], t_sin->nb[1])));
-    }
+    cur = sam_sincos(ctx0, cur);
 
-    struct ggml_tensor * pe_img_dense = ggml_cont(ctx0, ggml_permute(ctx0, cur, 2, 0, 1, 3));
+    // keep the dense positional encoding in token layout [C, W, H] - this is the layout used by the decoder
+    struct ggml_tensor * pe_img_dense = cur;
     ggml_build_forward_expand(gf, pe_img_dense);
 
     return pe_img_dense;
 }
 
-struct ggml_tensor* sam_layer_norm_2d(
-                    struct ggml_context * ctx0,
-                    struct ggml_tensor  * layer,
-                    int                   n_channels,
-                    struct ggml_tensor  * w,
-                    struct ggml_tensor  * b,
-                    float                 eps) {
-    // LayerNorm2d
-    // normalize along channel dimmension
-    // TODO: better implementation
-    layer = ggml_permute(ctx0,
-                ggml_norm(ctx0, ggml_cont(ctx0, ggml_permute(ctx0, layer, 1, 2, 0, 3)), eps),
-                2, 0, 1, 3);
+// Conv2d with a 3x3 kernel, stride 1 and zero padding 1 on the token layout: [C_in, W, H] -> [C_out, W, H]
+// every tap is a matmul of a shifted view of x with the [C_in, C_out] weights of the tap (see sam_conv_3x3_taps),
+// accumulated into the part of the output where the shifted input is inside the image. this avoids the 9x larger
+// im2col buffer and the zero padded copy of the input
+static struct ggml_tensor * sam_conv_2d_3x3(
+        struct ggml_context * ctx0,
+        struct ggml_tensor  * x,
+        struct ggml_tensor  * taps) {
+    const int64_t W = x->ne[1];
+    const int64_t H = x->ne[2];
 
-    layer = ggml_add(ctx0,
-              ggml_mul(ctx0,
-                  ggml_repeat(ctx0, ggml_reshape_3d(ctx0, w, 1, 1, n_channels), layer),
-                  layer),
-              ggml_repeat(ctx0, ggml_reshape_3d(ctx0, b, 1, 1, n_channels), layer));
+    auto tap = [&](int kx, int ky) {
+        return ggml_view_2d(ctx0, taps, taps->ne[0], taps->ne[1], taps->nb[1], (kx + 3*ky)*taps->nb[2]);
+    };
 
-    return layer;
-}
+    // the center tap covers the whole output
+    struct ggml_tensor * cur = ggml_mul_mat(ctx0, tap(1, 1), x);
 
-struct ggml_cgraph  * sam_encode_image(
-            const sam_ggml_model & model,
-                  sam_ggml_state & state,
-        const sam_image_f32 & img) {
+    for (int ky = 0; ky < 3; ++ky) {
+        for (int kx = 0; kx < 3; ++kx) {
+            if (kx == 1 && ky == 1) {
+                continue;
+            }
 
-    const auto & hparams = model.hparams;
-    const auto & enc     = model.enc_img;
+            // output (px, py) reads input (px + dx, py + dy)
+            const int dx = kx - 1;
+            const int dy = ky - 1;
 
-    const int32_t n_enc_state     = hparams.n_enc_state;
+            struct ggml_tensor * inp = ggml_view_3d(ctx0, x, x->ne[0], W - std::abs(dx), H - std::abs(dy), x->nb[1], x->nb[2],
+                    std::max(0, dx)*x->nb[1] + std::max(0, dy)*x->nb[2]);
+
+            cur = ggml_acc_inplace(ctx0, cur, ggml_mul_mat(ctx0, tap(kx, ky), inp), cur->nb[1], cur->nb[2], cur->nb[3],
+                    std::max(0, -dx)*cur->nb[1] + std::max(0, -dy)*cur->nb[2]);
+        }
+    }
+
+    return cur;
+}
+
+// rows [i0, i0 + n) of the linear layer w, b applied to x
+static struct ggml_tensor * sam_linear_rows(
+        struct ggml_context * ctx0,
+        struct ggml_tensor  * w,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * x,
+        int64_t               i0,
+        int64_t               n) {
+    struct ggml_tensor * w_rows = ggml_view_2d(ctx0, w, w->ne[0], n, w->nb[1], i0*w->nb[1]);
+    struct ggml_tensor * b_rows = ggml_view_1d(ctx0, b, n, i0*ggml_element_size(b));
+
+    return ggml_add_inplace(ctx0, ggml_mul_mat(ctx0, w_rows, x), b_rows);
+}
+
+// contiguous copy of t in the given type
+static struct ggml_tensor * sam_cont(struct ggml_context * ctx0, struct ggml_tensor * t, enum ggml_type type) {
+    if (t->type == type) {
+        return ggml_cont(ctx0, t);
+    }
+
+    return ggml_cpy(ctx0, t, ggml_new_tensor_4d(ctx0, type, t->ne[0], t->ne[1], t->ne[2], t->ne[3]));
+}
+
+struct ggml_cgraph  * sam_encode_image(
+            const sam_ggml_model & model,
+                  sam_ggml_state & state,
+        const sam_image_f32 & img) {
+
+    const auto & hparams = model.hparams;
+    const auto & enc     = model.enc_img;
+
+    const int32_t n_enc_state     = hparams.n_enc_state;
     const int32_t n_enc_layer     = hparams.n_enc_layer;
     const int32_t n_enc_head      = hparams.n_enc_head;
     const int32_t n_enc_head_dim  = hparams.n_enc_head_dim();
@@ -1138,9 +1846,12 @@ struct ggml_cgraph  * sam_encode_image(
     const int32_t n_img_size    = hparams.n_img_size();
     const int32_t n_window_size = hparams.n_window_size();
 
+    // type of the attention keys and values, see sam_params.f16_activations
+    // they are only used as the first operand of ggml_mul_mat - the second operand (Q, q_r, the softmax) must stay F32
+    const enum ggml_type act_type = state.f16_act ? GGML_TYPE_F16 : GGML_TYPE_F32;
+
     // since we are using ggml-alloc, this buffer only needs enough space to hold the ggml_tensor and ggml_cgraph structs, but not the tensor data
-    static size_t buf_size = ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead();
-    static std::vector<uint8_t> buf(buf_size);
+    auto & buf = state.buf_compute_meta;
 
     struct ggml_init_params ggml_params = {
         /*.mem_size   =*/ buf.size(),
@@ -1151,44 +1862,48 @@ struct ggml_cgraph  * sam_encode_image(
     struct ggml_context * ctx0   = ggml_init(ggml_params);
     struct ggml_cgraph  * gf     = ggml_new_graph(ctx0);
 
-    struct ggml_tensor * inp = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_img_size, n_img_size, 3, 1);
+    // the patch embedding is a 16x16 stride-16 convolution, so the patches do not overlap and it is a plain matrix
+    // multiplication: every row of inp is one patch, laid out as the flattened [kx, ky, c] kernel of proj_w
+    const int32_t n_patch_size = hparams.n_patch_size();
+    const int32_t n_img_embd   = hparams.n_img_embd();
+    const int32_t n_patch_elem = n_patch_size*n_patch_size*3;
+
+    struct ggml_tensor * inp = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_patch_elem, n_img_embd*n_img_embd);
     ggml_allocr_alloc(state.allocr, inp);
     if (!ggml_allocr_is_measure(state.allocr)) {
         float * data = (float *) ggml_get_data(inp);
 
         const int nx = img.nx;
         const int ny = img.ny;
-        const int n  = nx*ny;
 
         GGML_ASSERT(nx == n_img_size && ny == n_img_size);
 
-        for (int k = 0; k < 3; k++) {
-            for (int y = 0; y < ny; y++) {
-                for (int x = 0; x < nx; x++) {
-                    data[k*n + y*nx + x] = img.data[3*(y*nx + x) + k];
+        for (int py = 0; py < n_img_embd; py++) {
+            for (int px = 0; px < n_img_embd; px++) {
+                float * patch = data + (py*n_img_embd + px)*n_patch_elem;
+
+                for (int ky = 0; ky < n_patch_size; ky++) {
+                    const float * src = img.data.data() + 3*((py*n_patch_size + ky)*nx + px*n_patch_size);
+
+                    for (int kx = 0; kx < n_patch_size; kx++) {
+                        for (int k = 0; k < 3; k++) {
+                            patch[(k*n_patch_size + ky)*n_patch_size + kx] = src[3*kx + k];
+                        }
+                    }
                 }
             }
         }
     }
 
     // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L392
-    struct ggml_tensor * cur = ggml_conv_2d_sk_p0(ctx0, enc.proj_w, inp);
-    cur = ggml_add_inplace(ctx0,
-            cur,
-            ggml_repeat(ctx0, enc.proj_b, cur));
-
+    // the result is already in token layout [n_enc_state, W, H]
     // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L394
-    // keep in F32
-    cur = ggml_cont(ctx0,
-            ggml_permute(ctx0, cur, 1, 2, 0, 3));
-
-    // convert to F16
-    //cur = ggml_cpy(ctx0,
-    //        ggml_permute(ctx0, cur, 1, 2, 0, 3),
-    //        ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, n_enc_state, n_img_embd, n_img_embd));
+    struct ggml_tensor * cur = ggml_mul_mat(ctx0, ggml_reshape_2d(ctx0, enc.proj_w, n_patch_elem, n_enc_state), inp);
+    cur = ggml_reshape_4d(ctx0, cur, n_enc_state, n_img_embd, n_img_embd, 1);
 
+    // bias + absolute positional embedding in one pass
     // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L108-L109
-    cur = ggml_add_inplace(ctx0, cur, enc.pe);
+    cur = ggml_map_custom3_inplace(ctx0, cur, ggml_reshape_1d(ctx0, enc.proj_b, n_enc_state), enc.pe, ggml_sam_bias_residual, GGML_N_TASKS_MAX, NULL);
 
     struct ggml_tensor * inpL = cur;
 
@@ -1200,9 +1915,13 @@ struct ggml_cgraph  * sam_encode_image(
         {
             cur = ggml_norm(ctx0, inpL, hparams.eps);
 
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_mul(ctx0, cur, layer.norm1_w);
-            cur = ggml_add_inplace(ctx0, cur, layer.norm1_b);
+            // the affine of the global attention layers is folded into qkv_w at load time, see sam_fold_norm_affine
+            // the windowed layers apply it here - the padding added by the window partition has to stay zero
+            if (hparams.is_global_attn(il) == false) {
+                // cur = ln_0_w*cur + ln_0_b
+                cur = ggml_mul(ctx0, cur, layer.norm1_w);
+                cur = ggml_add_inplace(ctx0, cur, layer.norm1_b);
+            }
         }
 
         const int64_t w0 = cur->ne[1];
@@ -1219,36 +1938,51 @@ struct ggml_cgraph  * sam_encode_image(
 
         // self-attention
         {
-            cur = ggml_mul_mat(ctx0, layer.qkv_w, cur);
-            cur = ggml_add_inplace(ctx0, cur, layer.qkv_b);
-
             // split qkv into separate tensors
+            // the q, k and v rows of qkv_w are projected separately, so each of them comes out as a contiguous
+            // [n_enc_state, W*H, B] tensor instead of being split out of a permuted copy of the fused projection
             // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L225-L229
             const int B = cur->ne[3];
 
-            cur = ggml_reshape_4d(ctx0, cur, n_enc_state, 3, W*H, B);
-            cur = ggml_cont(ctx0, ggml_permute(ctx0, cur, 0, 3, 1, 2));
+            cur = ggml_reshape_3d(ctx0, cur, n_enc_state, W*H, B);
+
+            struct ggml_tensor * Q = sam_linear_rows(ctx0, layer.qkv_w, layer.qkv_b, cur, 0*n_enc_state, n_enc_state);
+            struct ggml_tensor * K = sam_linear_rows(ctx0, layer.qkv_w, layer.qkv_b, cur, 1*n_enc_state, n_enc_state);
 
-            struct ggml_tensor * Q;
-            struct ggml_tensor * K;
-            struct ggml_tensor * V;
+            // the value bias is folded into proj_b at load time, see sam_fold_v_bias
+            struct ggml_tensor * Wv = ggml_view_2d(ctx0, layer.qkv_w, n_enc_state, n_enc_state, layer.qkv_w->nb[1], 2*n_enc_state*layer.qkv_w->nb[1]);
 
-            Q = ggml_view_3d   (ctx0, cur, n_enc_state, W*H, B, cur->nb[1], cur->nb[2], 0*cur->nb[3]);
             Q = ggml_reshape_4d(ctx0, Q,   n_enc_head_dim, n_enc_head, W*H, B);
             Q = ggml_cont      (ctx0, ggml_permute(ctx0, Q, 0, 2, 1, 3));
-            Q = ggml_reshape_3d(ctx0, Q,   n_enc_head_dim, W*H, B*n_enc_head);
 
-            K = ggml_view_3d   (ctx0, cur, n_enc_state, W*H, B, cur->nb[1], cur->nb[2], 1*cur->nb[3]);
+            // the keys are only read by KQ, which takes the head-major view directly
             K = ggml_reshape_4d(ctx0, K,   n_enc_head_dim, n_enc_head, W*H, B);
-            K = ggml_cont      (ctx0, ggml_permute(ctx0, K, 0, 2, 1, 3));
-            K = ggml_reshape_3d(ctx0, K,   n_enc_head_dim, W*H, B*n_enc_head);
+            K = ggml_permute   (ctx0, K,   0, 2, 1, 3);
+            if (K->type != act_type) {
+                K = sam_cont(ctx0, K, act_type);
+            }
 
-            V = ggml_view_3d   (ctx0, cur, n_enc_state, W*H, B, cur->nb[1], cur->nb[2], 2*cur->nb[3]);
-            V = ggml_reshape_4d(ctx0, V,   n_enc_head_dim, n_enc_head, W*H, B);
-            V = ggml_cont      (ctx0, ggml_permute(ctx0, V, 1, 2, 0, 3)); // transposed
-            V = ggml_reshape_3d(ctx0, V,   W*H, n_enc_head_dim, B*n_enc_head);
+            struct ggml_tensor * V = {};
+            if (B == 1) {
+                // global attention: with the operands swapped the matmul produces the transposed values directly
+                // the weights are the second operand, so they are converted to F32 (n_enc_state^2, not W*H*n_enc_state)
+                // no copy of the values is made, so they stay F32 in F16 activation mode
+                Wv = ggml_cpy(ctx0, Wv, ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_enc_state, n_enc_state));
+
+                V = ggml_mul_mat   (ctx0, cur, Wv); // [W*H, n_enc_state]
+                V = ggml_reshape_3d(ctx0, V,   W*H, n_enc_head_dim, n_enc_head);
+            } else {
+                // windowed attention: the windows are the batch dim of cur, and ggml_mul_mat only broadcasts its first
+                // operand over the batch of the second - the values are transposed with a copy
+                V = ggml_mul_mat   (ctx0, Wv,  cur);
+                V = ggml_reshape_4d(ctx0, V,   n_enc_head_dim, n_enc_head, W*H, B);
+                V = sam_cont       (ctx0, ggml_permute(ctx0, V, 1, 2, 0, 3), act_type); // transposed
+                V = ggml_reshape_3d(ctx0, V,   W*H, n_enc_head_dim, B*n_enc_head);
+            }
+
+            struct ggml_tensor * KQ = ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, K, Q), W*H, W*H, B*n_enc_head);
 
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+            Q = ggml_reshape_3d(ctx0, Q,   n_enc_head_dim, W*H, B*n_enc_head);
 
             struct ggml_tensor * KQ_scaled =
                 ggml_scale_inplace(ctx0,
@@ -1256,8 +1990,10 @@ struct ggml_cgraph  * sam_encode_image(
                         ggml_new_f32(ctx0, 1.0f/sqrtf(n_enc_head_dim))
                         );
 
-            struct ggml_tensor * rw = ggml_get_rel_pos(ctx0, layer.rel_pos_w, W, W);
-            struct ggml_tensor * rh = ggml_get_rel_pos(ctx0, layer.rel_pos_h, H, H);
+            struct ggml_tensor * rw = layer.rel_pos_w_tab;
+            struct ggml_tensor * rh = layer.rel_pos_h_tab;
+
+            GGML_ASSERT(rw->ne[1] == W && rh->ne[1] == H);
 
             struct ggml_tensor * q_r = ggml_reshape_4d(ctx0, Q, n_enc_head_dim, W, H, B*n_enc_head);
 
@@ -1283,7 +2019,6 @@ struct ggml_cgraph  * sam_encode_image(
                         n_enc_state, W, H, B);
 
             cur = ggml_mul_mat(ctx0, layer.proj_w, cur);
-            cur = ggml_add_inplace(ctx0, cur, layer.proj_b);
         }
 
         if (hparams.is_global_attn(il) == false) {
@@ -1291,47 +2026,50 @@ struct ggml_cgraph  * sam_encode_image(
             cur = ggml_win_unpart(ctx0, cur, w0, h0, n_window_size);
         }
 
-        cur = ggml_add_inplace(ctx0, cur, inpL);
+        // the bias is per channel, so it is added after the window reversal together with the residual
+        cur = ggml_map_custom3_inplace(ctx0, cur, layer.proj_b, inpL, ggml_sam_bias_residual, GGML_N_TASKS_MAX, NULL);
 
         struct ggml_tensor * inpFF = cur;
 
         // feed-forward network
         {
-            // norm
-            {
-                cur = ggml_norm(ctx0, inpFF, hparams.eps);
-
-                // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_mul(ctx0, cur, layer.norm2_w);
-                cur = ggml_add_inplace(ctx0, cur, layer.norm2_b);
-            }
+            // norm - the affine is folded into mlp_lin1_w at load time
+            cur = ggml_norm(ctx0, inpFF, hparams.eps);
 
-            // fully connected
+            // fully connected + GELU activation
             cur = ggml_mul_mat(ctx0, layer.mlp_lin1_w, cur);
-            cur = ggml_add_inplace(ctx0, cur, layer.mlp_lin1_b);
-
-            // GELU activation
-            cur = ggml_gelu(ctx0, cur);
+            cur = ggml_map_custom2_inplace(ctx0, cur, layer.mlp_lin1_b, ggml_sam_bias_gelu, GGML_N_TASKS_MAX, NULL);
 
             // projection
             cur = ggml_mul_mat(ctx0, layer.mlp_lin2_w, cur);
-            cur = ggml_add_inplace(ctx0, cur, layer.mlp_lin2_b);
         }
 
-        inpL = ggml_add(ctx0, cur, inpFF);
+        inpL = ggml_map_custom3_inplace(ctx0, cur, layer.mlp_lin2_b, inpFF, ggml_sam_bias_residual, GGML_N_TASKS_MAX, NULL);
     }
 
-    cur = ggml_cont(ctx0, ggml_permute(ctx0, inpL, 2, 0, 1, 3));
+    // the neck runs on the token layout [C, W, H] of the encoder, which is also the layout of the stored embedding
+    // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/image_encoder.py#L78-L95
 
-    cur = ggml_conv_2d_sk_p0(ctx0, enc.neck_conv_0, cur);
+    // Conv2d 1x1 - a plain matmul over the channels
+    cur = ggml_mul_mat(ctx0, ggml_reshape_2d(ctx0, enc.neck_conv_0, n_enc_state, n_enc_out_chans), inpL);
 
-    cur = sam_layer_norm_2d(ctx0, cur, n_enc_out_chans, enc.neck_norm_0_w, enc.neck_norm_0_b, hparams.eps);
+    // LayerNorm2d - a plain layer norm along the channels in this layout
+    cur = ggml_norm_inplace(ctx0, cur, hparams.eps);
+    cur = ggml_add_inplace(ctx0, ggml_mul(ctx0, cur, enc.neck_norm_0_w), enc.neck_norm_0_b);
 
-    cur = ggml_conv_2d_s1_ph(ctx0, enc.neck_conv_1, cur);
+    // Conv2d 3x3, padding 1
+    cur = sam_conv_2d_3x3(ctx0, cur, enc.neck_conv_1_taps);
 
-    cur = sam_layer_norm_2d(ctx0, cur, n_enc_out_chans, enc.neck_norm_1_w, enc.neck_norm_1_b, hparams.eps);
-
-    cur = ggml_cpy(state.ctx_img, cur, state.embd_img);
+    // LayerNorm2d
+    cur = ggml_norm_inplace(ctx0, cur, hparams.eps);
+    cur = ggml_add_inplace(ctx0, ggml_mul(ctx0, cur, enc.neck_norm_1_w), enc.neck_norm_1_b);
+
+    // store the embedding once per image
+    if (state.embd_img->type == GGML_TYPE_I8) {
+        cur = ggml_map_custom3_inplace(ctx0, state.embd_img, cur, state.embd_img_scale, ggml_sam_quantize_embd, GGML_N_TASKS_MAX, NULL);
+    } else {
+        cur = ggml_cpy(ctx0, cur, state.embd_img);
+    }
 
     ggml_build_forward_expand(gf, cur);
     ggml_disconnect_node_from_graph(state.embd_img);
@@ -1344,6 +2082,32 @@ struct ggml_cgraph  * sam_encode_image(
 }
 
 
+// Conv2d with kernel size 2 and stride 2 on the token layout: [C_in, W*H] -> [C_out, W/2*H/2]
+// the 2x2 patches are gathered into rows (space to depth) and multiplied with the weights in a single matmul
+struct ggml_tensor * sam_conv_2d_k2s2(
+    struct ggml_context * ctx0,
+     struct ggml_tensor * x,
+     struct ggml_tensor * w,
+     struct ggml_tensor * b,
+                    int   W,
+                    int   H) {
+    const int64_t n_in = w->ne[2];
+
+    // [(C_in, kx), x, ky, y] -> [(C_in, kx), ky, x, y]
+    struct ggml_tensor * cur = ggml_reshape_4d(ctx0, x, 2*n_in, W/2, 2, H/2);
+    cur = ggml_cont(ctx0, ggml_permute(ctx0, cur, 0, 2, 1, 3));
+    cur = ggml_reshape_2d(ctx0, cur, 4*n_in, (W/2)*(H/2));
+
+    // [2, 2, C_in, C_out] -> [C_in*2*2, C_out], rows ordered as (C_in, kx, ky)
+    struct ggml_tensor * w_t = ggml_cont(ctx0, ggml_permute(ctx0, w, 1, 2, 0, 3));
+    w_t = ggml_reshape_2d(ctx0, w_t, 4*n_in, w->ne[3]);
+
+    cur = ggml_mul_mat(ctx0, w_t, cur);
+    cur = ggml_add_inplace(ctx0, cur, b);
+
+    return cur;
+}
+
 struct prompt_encoder_result {
     struct ggml_tensor * embd_prompt_sparse = {};
     struct ggml_tensor * embd_prompt_dense = {};
@@ -1355,7 +2119,11 @@ struct prompt_encoder_result {
 // - boxes
 // - masks
 //
-// TODO: currently just encode a single point for simplicity
+// TODO: currently just encode a single point per prompt for simplicity
+//
+// every point is a separate prompt - the sparse embeddings are [C, 2, n_points], one batch entry per point
+//
+// mask_input is either empty or holds one low-res mask (logits, as produced by the decoder) per point
 //
 prompt_encoder_result sam_encode_prompt(
         const sam_ggml_model     & model,
@@ -1364,77 +2132,109 @@ prompt_encoder_result sam_encode_prompt(
                   sam_ggml_state & state,
                         int   nx,
                         int   ny,
-                  sam_point   point) {
+        const std::vector<sam_point> & points,
+        const std::vector<float>     & mask_input) {
 
     const auto & hparams = model.hparams;
     const auto & enc = model.enc_prompt;
 
-    // transform points
-    // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/automatic_mask_generator.py#L276
-    {
-        const int nmax = std::max(nx, ny);
-
-        const float scale = hparams.n_img_size() / (float) nmax;
-
-        const int nx_new = int(nx*scale + 0.5f);
-        const int ny_new = int(ny*scale + 0.5f);
-
-        point.x = point.x*(float(nx_new)/nx) + 0.5f;
-        point.y = point.y*(float(ny_new)/ny) + 0.5f;
-    }
+    const int n_points = (int) points.size();
 
-    struct ggml_tensor * inp = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2, 2);
+    struct ggml_tensor * inp = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2, 2*n_points);
 
     ggml_allocr_alloc(state.allocr, inp);
     if (!ggml_allocr_is_measure(state.allocr)) {
-        // set the input by converting the [0, 1] coordinates to [-1, 1]
         float * data = (float *) inp->data;
 
-        data[0] = 2.0f*(point.x / hparams.n_img_size()) - 1.0f;
-        data[1] = 2.0f*(point.y / hparams.n_img_size()) - 1.0f;
+        for (int i = 0; i < n_points; ++i) {
+            sam_point point = points[i];
 
-        // padding
-        // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L81-L85
-        data[2] = 2.0f*(0.0f) - 1.0f;
-        data[3] = 2.0f*(0.0f) - 1.0f;
-    }
+            // transform points
+            // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/automatic_mask_generator.py#L276
+            {
+                const int nmax = std::max(nx, ny);
 
-    struct ggml_tensor * cur = ggml_mul_mat(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, enc.pe)), inp);
+                const float scale = hparams.n_img_size() / (float) nmax;
 
-    cur = ggml_scale(ctx0, cur, ggml_new_f32(ctx0, float(2.0f*M_PI)));
+                const int nx_new = int(nx*scale + 0.5f);
+                const int ny_new = int(ny*scale + 0.5f);
 
-    // concat
-    // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L192
-    {
-        struct ggml_tensor * t_sin = ggml_map_custom1(ctx0, cur, ggml_sam_sin, GGML_N_TASKS_MAX, NULL);
-        struct ggml_tensor * t_cos = ggml_map_custom1(ctx0, cur, ggml_sam_cos, GGML_N_TASKS_MAX, NULL);
+                point.x = point.x*(float(nx_new)/nx) + 0.5f;
+                point.y = point.y*(float(ny_new)/ny) + 0.5f;
+            }
+
+            // set the input by converting the [0, 1] coordinates to [-1, 1]
+            data[4*i + 0] = 2.0f*(point.x / hparams.n_img_size()) - 1.0f;
+            data[4*i + 1] = 2.0f*(point.y / hparams.n_img_size()) - 1.0f;
 
-        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, t_sin->ne[0] + t_cos->ne[0], cur->ne[1]);
+            // padding
+            // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L81-L85
+            data[4*i + 2] = 2.0f*(0.0f) - 1.0f;
+            data[4*i + 3] = 2.0f*(0.0f) - 1.0f;
+        }
+    }
+
+    struct ggml_tensor * cur = ggml_mul_mat(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, enc.pe)), inp);
 
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, t_sin, ggml_view_2d(ctx0, cur, t_sin->ne[0], t_sin->ne[1], cur->nb[1], 0)));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, t_cos, ggml_view_2d(ctx0, cur, t_sin->ne[0], t_sin->ne[1], cur->nb[1], t_sin->nb[1])));
+    // scale by 2*pi, sin, cos and concat in a single op
+    // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L192
+    cur = sam_sincos(ctx0, cur);
+    cur = ggml_reshape_3d(ctx0, cur, cur->ne[0], 2, n_points);
 
+    {
         // overwrite label == -1 with not_a_point_embed.weight
         // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L86
         // TODO: extend for multiple points
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, enc.not_a_pt_embd_w, ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], cur->nb[1])));
+        struct ggml_tensor * v = ggml_view_3d(ctx0, cur, cur->ne[0], 1, n_points, cur->nb[1], cur->nb[2], cur->nb[1]);
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, ggml_repeat(ctx0, enc.not_a_pt_embd_w, v), v));
     }
 
     // add point_embeddings[1] to label == 1
     // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L90
-    struct ggml_tensor * v = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], 0);
+    struct ggml_tensor * v = ggml_view_3d(ctx0, cur, cur->ne[0], 1, n_points, cur->nb[1], cur->nb[2], 0);
     ggml_build_forward_expand(gf, ggml_cpy(ctx0, ggml_add_inplace(ctx0, v, enc.pt_embd[1]), v));
 
     struct ggml_tensor * embd_prompt_sparse = cur;
     ggml_build_forward_expand(gf, embd_prompt_sparse);
 
-    struct ggml_tensor * embd_prompt_dense = ggml_repeat(ctx0,
-            ggml_cont(ctx0,
-                ggml_view_3d(ctx0, enc.no_mask_embd_w,
-                    1, 1, enc.no_mask_embd_w->ne[0], enc.no_mask_embd_w->nb[0], enc.no_mask_embd_w->nb[0], 0)),
-            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hparams.n_img_embd(), hparams.n_img_embd(), hparams.n_enc_out_chans));
+    // without a mask prompt, the dense embedding is the same no_mask_embed vector for every image token,
+    // so it is kept as a single [C] row and broadcast by the decoder instead of being repeated to [C, W, H]
+    // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L164-L166
+    struct ggml_tensor * embd_prompt_dense = enc.no_mask_embd_w;
+
+    if (!mask_input.empty()) {
+        // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L150
+        const int n_mask = 4*hparams.n_img_embd();
+
+        if (!enc.has_mask_down || (int) mask_input.size() != n_mask*n_mask*n_points) {
+            fprintf(stderr, "%s: invalid mask prompt\n", __func__);
+            return {};
+        }
+
+        struct ggml_tensor * inp_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 1, n_mask, n_mask*n_points);
+
+        ggml_allocr_alloc(state.allocr, inp_mask);
+        if (!ggml_allocr_is_measure(state.allocr)) {
+            memcpy(inp_mask->data, mask_input.data(), ggml_nbytes(inp_mask));
+        }
+
+        // in the token layout the downscaling is a chain of matmuls, see sam_conv_2d_k2s2
+        cur = sam_conv_2d_k2s2(ctx0, inp_mask, enc.mask_down_0_w, enc.mask_down_0_b, n_mask, n_mask*n_points);
+        cur = ggml_norm_inplace(ctx0, cur, hparams.eps);
+        cur = ggml_add_inplace(ctx0, ggml_mul(ctx0, cur, enc.mask_down_1_w), enc.mask_down_1_b);
+        cur = ggml_gelu_inplace(ctx0, cur);
+
+        cur = sam_conv_2d_k2s2(ctx0, cur, enc.mask_down_3_w, enc.mask_down_3_b, n_mask/2, (n_mask/2)*n_points);
+        cur = ggml_norm_inplace(ctx0, cur, hparams.eps);
+        cur = ggml_add_inplace(ctx0, ggml_mul(ctx0, cur, enc.mask_down_4_w), enc.mask_down_4_b);
+        cur = ggml_gelu_inplace(ctx0, cur);
 
-    ggml_build_forward_expand(gf, embd_prompt_dense);
+        cur = ggml_mul_mat(ctx0, ggml_reshape_2d(ctx0, enc.mask_down_6_w, enc.mask_down_6_w->ne[2], enc.mask_down_6_w->ne[3]), cur);
+        cur = ggml_add_inplace(ctx0, cur, enc.mask_down_6_b);
+
+        // [C, W*H, n_points]
+        embd_prompt_dense = ggml_reshape_3d(ctx0, cur, cur->ne[0], cur->ne[1]/n_points, n_points);
+    }
 
     //printf("used_mem = %zu\n", ggml_used_mem(ctx0));
 
@@ -1443,41 +2243,77 @@ prompt_encoder_result sam_encode_prompt(
     res.embd_prompt_dense  = embd_prompt_dense;
     return res;}
 
-struct ggml_tensor* sam_decode_mask_transformer_attn(
+// project the keys into the per-head layout [n_embd_head, n_kv, n_head, B] used by sam_decode_mask_transformer_attn_kv
+struct ggml_tensor * sam_decode_mask_transformer_attn_k(
     const sam_layer_dec_transformer_attn & attn,
-                      struct ggml_tensor * queries,
                       struct ggml_tensor * keys,
+                     struct ggml_context * ctx0,
+                    const sam_ggml_model & model) {
+    const int n_head = model.hparams.n_dec_heads;
+
+    struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, attn.k_w, keys);
+    Kcur = ggml_add_inplace(ctx0, Kcur, attn.k_b);
+
+    // no copy - ggml_mul_mat only needs the rows of K to be contiguous
+    struct ggml_tensor * K = ggml_reshape_4d(ctx0, Kcur, Kcur->ne[0]/n_head, n_head, Kcur->ne[1], Kcur->ne[2]);
+    K = ggml_permute(ctx0, K, 0, 2, 1, 3);
+
+    return K;
+}
+
+// project the values into the transposed per-head layout [n_kv, n_embd_head, n_head, B]
+struct ggml_tensor * sam_decode_mask_transformer_attn_v(
+    const sam_layer_dec_transformer_attn & attn,
                       struct ggml_tensor * values,
                      struct ggml_context * ctx0,
-                         const sam_ggml_model & model) {
+                    const sam_ggml_model & model) {
+    const int n_head = model.hparams.n_dec_heads;
+
+    // the bias is not added here - the softmax rows sum to 1, so it is added to the attention output instead
+    // see sam_decode_mask_transformer_attn_kv
+    struct ggml_tensor * V = {};
+    if (values->ne[2] == 1) {
+        // values^T * v_w produces the projection already transposed, no copy needed
+        // ggml_mul_mat needs an F32 second operand, so the (small) weight is converted first
+        struct ggml_tensor * v_w = ggml_cpy(ctx0, attn.v_w, ggml_new_tensor(ctx0, GGML_TYPE_F32, 2, attn.v_w->ne));
+
+        V = ggml_mul_mat(ctx0, values, v_w);
+        V = ggml_reshape_4d(ctx0, V, V->ne[0], V->ne[1]/n_head, n_head, 1);
+    } else {
+        struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, attn.v_w, values);
+
+        V = ggml_reshape_4d(ctx0, Vcur, Vcur->ne[0]/n_head, n_head, Vcur->ne[1], Vcur->ne[2]);
+        V = ggml_cont(ctx0, ggml_permute(ctx0, V, 1, 2, 0, 3)); // transposed
+    }
+
+    return V;
+}
+
+// attention with already projected keys and values - see sam_decode_mask_transformer_attn_k/v
+struct ggml_tensor * sam_decode_mask_transformer_attn_kv(
+    const sam_layer_dec_transformer_attn & attn,
+                      struct ggml_tensor * queries,
+                      struct ggml_tensor * K,
+                      struct ggml_tensor * V,
+                     struct ggml_context * ctx0,
+                    const sam_ggml_model & model) {
     const auto & hparams = model.hparams;
     const int n_head = hparams.n_dec_heads;
 
     struct ggml_tensor * Qcur = {};
-    struct ggml_tensor * Kcur = {};
-    struct ggml_tensor * Vcur = {};
 
     Qcur = ggml_mul_mat(ctx0, attn.q_w, queries);
     Qcur = ggml_add_inplace(ctx0, Qcur, attn.q_b);
 
-    Kcur = ggml_mul_mat(ctx0, attn.k_w, keys);
-    Kcur = ggml_add_inplace(ctx0, Kcur, attn.k_b);
-
-    Vcur = ggml_mul_mat(ctx0, attn.v_w, values);
-    Vcur = ggml_add_inplace(ctx0, Vcur, attn.v_b);
+    if (Qcur->ne[2] < K->ne[3]) {
+        // the image-side queries are shared across the batch - expand them only after the projection
+        Qcur = ggml_repeat(ctx0, Qcur, ggml_new_tensor_3d(ctx0, Qcur->type, Qcur->ne[0], Qcur->ne[1], K->ne[3]));
+    }
 
     struct ggml_tensor * Q = {};
-    struct ggml_tensor * K = {};
-    struct ggml_tensor * V = {};
 
     Q = ggml_reshape_4d(ctx0, Qcur, Qcur->ne[0]/n_head, n_head, Qcur->ne[1], Qcur->ne[2]);
-    Q = ggml_cont(ctx0, ggml_permute(ctx0, Q, 0, 2, 1, 3));
-
-    K = ggml_reshape_4d(ctx0, Kcur, Kcur->ne[0]/n_head, n_head, Kcur->ne[1], Kcur->ne[2]);
-    K = ggml_cont(ctx0, ggml_permute(ctx0, K, 0, 2, 1, 3));
-
-    V = ggml_reshape_4d(ctx0, Vcur, Vcur->ne[0]/n_head, n_head, Vcur->ne[1], Vcur->ne[2]);
-    V = ggml_cont(ctx0, ggml_permute(ctx0, V, 0, 2, 1, 3));
+    Q = ggml_permute(ctx0, Q, 0, 2, 1, 3);
 
     // Q * K
     struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
@@ -1489,17 +2325,65 @@ struct ggml_tensor* sam_decode_mask_transformer_attn(
 
     struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_scaled);
 
-    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, KQ_soft_max, ggml_cont(ctx0, ggml_transpose(ctx0, V)));
+    // V is the first operand so that image values shared across the batch broadcast over the per-prompt scores
+    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 
-    struct ggml_tensor * KQV_merged = ggml_cont(ctx0, ggml_transpose(ctx0, KQV));
-    KQV_merged = ggml_cont(ctx0, ggml_permute(ctx0, KQV_merged, 0, 2, 1, 3));
+    struct ggml_tensor * KQV_merged = ggml_cont(ctx0, ggml_permute(ctx0, KQV, 0, 2, 1, 3));
     KQV_merged = ggml_reshape_3d(ctx0, KQV_merged, KQV_merged->ne[0]*KQV_merged->ne[1], KQV_merged->ne[2], KQV_merged->ne[3]);
+    KQV_merged = ggml_add_inplace(ctx0, KQV_merged, attn.v_b);
     KQV_merged = ggml_mul_mat(ctx0, attn.out_w, KQV_merged);
     KQV_merged = ggml_add_inplace(ctx0, KQV_merged, attn.out_b);
 
     return KQV_merged;
 }
 
+struct ggml_tensor* sam_decode_mask_transformer_attn(
+    const sam_layer_dec_transformer_attn & attn,
+                      struct ggml_tensor * queries,
+                      struct ggml_tensor * keys,
+                      struct ggml_tensor * values,
+                     struct ggml_context * ctx0,
+                    const sam_ggml_model & model) {
+    struct ggml_tensor * K = sam_decode_mask_transformer_attn_k(attn, keys,   ctx0, model);
+    struct ggml_tensor * V = sam_decode_mask_transformer_attn_v(attn, values, ctx0, model);
+
+    return sam_decode_mask_transformer_attn_kv(attn, queries, K, V, ctx0, model);
+}
+
+// ConvTranspose2d with kernel size 2 and stride 2 on the token layout, followed by an optional LayerNorm2d and a
+// GELU: [C_in, W*H, B] -> [C_out, 2W*2H, B]
+// every input pixel produces its own 2x2 output block, so this is a single matmul with the weights reordered at load
+// time (see sam_conv_transpose_k2s2_weights), followed by one fused pass that does the pixel shuffle, the bias,
+// the norm and the activation. ln_wb is the [weight | bias] of the norm or NULL, eps has to outlive the graph
+struct ggml_tensor * sam_conv_transpose_2d_k2s2_gelu(
+    struct ggml_context * ctx0,
+     struct ggml_tensor * x,
+     struct ggml_tensor * w_t,
+     struct ggml_tensor * b,
+     struct ggml_tensor * ln_wb,
+            const float & eps,
+                    int   W,
+                    int   H) {
+    const int64_t n_out = w_t->ne[1]/4;
+    const int64_t n_b   = x->ne[2];
+
+    struct ggml_tensor * cur = ggml_mul_mat(ctx0, w_t, x);
+    cur = ggml_reshape_4d(ctx0, cur, 4*n_out, W, H, n_b);
+
+    if (ln_wb) {
+        cur = ggml_map_custom3(ctx0, cur, b, ln_wb, ggml_sam_upscale_norm_gelu, GGML_N_TASKS_MAX, (void *) &eps);
+    } else {
+        cur = ggml_map_custom2(ctx0, cur, b, ggml_sam_upscale_gelu, GGML_N_TASKS_MAX, NULL);
+    }
+
+    return ggml_reshape_3d(ctx0, cur, n_out, 4*W*H, n_b);
+}
+
+// the stacked weights of the n hypernetwork MLPs starting at i0
+static struct ggml_tensor * sam_hypernet_view(struct ggml_context * ctx0, struct ggml_tensor * t, int i0, int n) {
+    return ggml_view_3d(ctx0, t, t->ne[0], t->ne[1], n, t->nb[1], t->nb[2], i0*t->nb[2]);
+}
+
 struct ggml_tensor * sam_decode_mask_mlp_relu_3(
      struct ggml_tensor * in,
      struct ggml_tensor * w_0,
@@ -1527,17 +2411,33 @@ struct ggml_tensor * sam_decode_mask_mlp_relu_3(
     return cur;
 }
 
+// the image embedding as F32 in token layout [C, W*H], converted from the storage type if needed
+static struct ggml_tensor * sam_embd_img_f32(struct ggml_context * ctx0, const sam_ggml_state & state) {
+    struct ggml_tensor * embd_img = ggml_reshape_2d(ctx0, state.embd_img, state.embd_img->ne[0], state.embd_img->ne[1]*state.embd_img->ne[2]);
+
+    switch (embd_img->type) {
+        case GGML_TYPE_F32:
+            return embd_img;
+        case GGML_TYPE_I8:
+            return ggml_map_custom3_inplace(ctx0,
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, embd_img->ne[0], embd_img->ne[1]),
+                    embd_img, state.embd_img_scale, ggml_sam_dequantize_embd, GGML_N_TASKS_MAX, NULL);
+        default:
+            return ggml_cpy(ctx0, embd_img, ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, embd_img->ne[0], embd_img->ne[1]));
+    }
+}
+
 bool sam_decode_mask(
                     const sam_ggml_model & model,
         const prompt_encoder_result & prompt,
                  struct ggml_tensor * pe_img,
                 struct ggml_context * ctx0,
                 struct ggml_cgraph  * gf,
-                          sam_ggml_state & state) {
+                          sam_ggml_state & state,
+                                 bool   multimask_output) {
 
     const auto & hparams = model.hparams;
     const auto & dec = model.dec;
-    const int n_img_embd = hparams.n_img_embd();
 
     struct ggml_tensor * tokens = {};
     {
@@ -1548,9 +2448,14 @@ bool sam_decode_mask(
         tokens = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, dec.iou_token_w->ne[0], dec.iou_token_w->ne[1] + dec.mask_tokens_w->ne[1] + sparse->ne[1], sparse->ne[2]);
 
         const size_t offsets[3] = { 0, dec.iou_token_w->ne[1]*tokens->nb[1], dec.iou_token_w->ne[1]*tokens->nb[1] + dec.mask_tokens_w->ne[1]*tokens->nb[1] };
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, dec.iou_token_w,   ggml_view_2d(ctx0, tokens, tokens->ne[0], dec.iou_token_w->ne[1],   tokens->nb[1], offsets[0])));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, dec.mask_tokens_w, ggml_view_2d(ctx0, tokens, tokens->ne[0], dec.mask_tokens_w->ne[1], tokens->nb[1], offsets[1])));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, sparse,            ggml_view_2d(ctx0, tokens, tokens->ne[0], sparse->ne[1],            tokens->nb[1], offsets[2])));
+
+        // the output tokens are the same for every prompt in the batch
+        struct ggml_tensor * iou_tokens  = ggml_view_3d(ctx0, tokens, tokens->ne[0], dec.iou_token_w->ne[1],   tokens->ne[2], tokens->nb[1], tokens->nb[2], offsets[0]);
+        struct ggml_tensor * mask_tokens = ggml_view_3d(ctx0, tokens, tokens->ne[0], dec.mask_tokens_w->ne[1], tokens->ne[2], tokens->nb[1], tokens->nb[2], offsets[1]);
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, ggml_repeat(ctx0, dec.iou_token_w,   iou_tokens),  iou_tokens));
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, ggml_repeat(ctx0, dec.mask_tokens_w, mask_tokens), mask_tokens));
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, sparse, ggml_view_3d(ctx0, tokens, tokens->ne[0], sparse->ne[1], sparse->ne[2], tokens->nb[1], tokens->nb[2], offsets[2])));
         // TODO: Sparse prompt embeddings can have more than one point
     }
 
@@ -1559,53 +2464,31 @@ bool sam_decode_mask(
     struct ggml_tensor * pos_src = {};
     int srcNE[4] = { 0, 0, 0, 0 };
     {
-        // Expand per-image data in the batch direction to be per-mask
+        // The image embedding and the dense positional encoding are already stored in token layout [C, W*H],
+        // so they are flattened without a copy and shared across the prompts in the batch via broadcasting
+        // instead of being expanded per-mask
         // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/mask_decoder.py#L125
-        src = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, state.embd_img->ne[0], state.embd_img->ne[1], state.embd_img->ne[2], tokens->ne[2]);
-
-        src = ggml_add(ctx0,
-            ggml_repeat(ctx0,
-                state.embd_img,
-                src),
-            prompt.embd_prompt_dense);
-
-        srcNE[0] = src->ne[0];
-        srcNE[1] = src->ne[1];
-        srcNE[2] = src->ne[2];
-        srcNE[3] = src->ne[3];
-
-        // flatten & permute
         // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/transformer.py#L83
-        src = ggml_cont(ctx0, ggml_permute(ctx0,
-            ggml_view_3d(ctx0,
-                src,
-                src->ne[0]*src->ne[1],
-                src->ne[2],
-                src->ne[3],
-                src->nb[2],
-                src->nb[3],
-                0),
-            1, 0, 2, 3));
-
-        pos_src = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, pe_img->ne[0], pe_img->ne[1], pe_img->ne[2], tokens->ne[2]);
-        pos_src = ggml_repeat(ctx0,
-            pe_img,
-            pos_src);
-
-        // flatten & permute
-        // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/transformer.py#L83
-        pos_src = ggml_cont(ctx0, ggml_permute(ctx0,
-            ggml_view_3d(ctx0,
-                pos_src,
-                pos_src->ne[0]*pos_src->ne[1],
-                pos_src->ne[2],
-                pos_src->ne[3],
-                pos_src->nb[2],
-                pos_src->nb[3],
-                0),
-            1, 0, 2, 3));
+        srcNE[0] = state.embd_img->ne[1];
+        srcNE[1] = state.embd_img->ne[2];
+        srcNE[2] = state.embd_img->ne[0];
+        srcNE[3] = tokens->ne[2];
+
+        struct ggml_tensor * embd_img = sam_embd_img_f32(ctx0, state);
+
+        if (ggml_nelements(prompt.embd_prompt_dense) == embd_img->ne[0]) {
+            src = ggml_add(ctx0, embd_img, prompt.embd_prompt_dense);
+        } else {
+            // a dense embedding from a mask prompt - one per prompt in the batch
+            src = ggml_add(ctx0, prompt.embd_prompt_dense, embd_img);
+        }
+
+        pos_src = ggml_reshape_2d(ctx0, pe_img, pe_img->ne[0], pe_img->ne[1]*pe_img->ne[2]);
     }
 
+    // the cached keys and values were computed with the no-mask dense embedding
+    const bool use_img_cache = state.dec_k0 && state.dec_v0 && prompt.embd_prompt_dense == model.enc_prompt.no_mask_embd_w;
+
     struct ggml_tensor * queries = tokens;
     struct ggml_tensor * keys = src;
     {
@@ -1635,9 +2518,16 @@ bool sam_decode_mask(
             // Cross attention block, tokens attending to image embedding
             // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/transformer.py#L163
             struct ggml_tensor * q_1 = ggml_add(ctx0, queries, tokens);
-            struct ggml_tensor * k_1 = ggml_add(ctx0, keys, pos_src);
 
-            struct ggml_tensor * cross_attn_token_to_img = sam_decode_mask_transformer_attn(tfm_layer.cross_attn_token_to_img, q_1, k_1, keys, ctx0, model);
+            struct ggml_tensor * cross_attn_token_to_img = {};
+            if (i == 0 && use_img_cache) {
+                // the first layer keys and values depend only on the image - reuse the ones computed by sam_compute_embd_img
+                cross_attn_token_to_img = sam_decode_mask_transformer_attn_kv(tfm_layer.cross_attn_token_to_img, q_1, state.dec_k0, state.dec_v0, ctx0, model);
+            } else {
+                struct ggml_tensor * k_1 = ggml_add(ctx0, keys, pos_src);
+
+                cross_attn_token_to_img = sam_decode_mask_transformer_attn(tfm_layer.cross_attn_token_to_img, q_1, k_1, keys, ctx0, model);
+            }
 
             queries = ggml_add_inplace(ctx0, queries, cross_attn_token_to_img);
             queries = ggml_norm_inplace(ctx0, queries, hparams.eps_decoder_transformer);
@@ -1671,7 +2561,8 @@ bool sam_decode_mask(
             struct ggml_tensor * k_2 = ggml_add(ctx0, keys, pos_src);
 
             struct ggml_tensor * cross_attn_img_to_token = sam_decode_mask_transformer_attn(tfm_layer.cross_attn_img_to_token, k_2, q_2, queries, ctx0, model);
-            keys = ggml_add_inplace(ctx0, keys, cross_attn_img_to_token);
+            // keys may still be shared across the batch, so broadcast them onto the per-prompt attention output
+            keys = ggml_add_inplace(ctx0, cross_attn_img_to_token, keys);
             keys = ggml_norm_inplace(ctx0, keys, hparams.eps_decoder_transformer);
             keys = ggml_add_inplace(ctx0,
                     ggml_mul(ctx0, keys, tfm_layer.norm4_w),
@@ -1695,60 +2586,51 @@ bool sam_decode_mask(
 
     struct ggml_tensor * iou_pred = ggml_view_2d(ctx0, queries, queries->ne[0], queries->ne[2], queries->nb[2], 0);
     const int num_mask_tokens = 4; // num_multimask_outputs + 1
-    struct ggml_tensor * mask_tokens_out = ggml_view_3d(ctx0, queries, queries->ne[0], num_mask_tokens, queries->ne[2], queries->nb[1], num_mask_tokens*queries->nb[1], queries->nb[1]);
+    struct ggml_tensor * mask_tokens_out = ggml_view_3d(ctx0, queries, queries->ne[0], num_mask_tokens, queries->ne[2], queries->nb[1], queries->nb[2], queries->nb[1]);
+
+    // Select the correct mask or masks for output
+    // only the selected mask tokens are run through the hypernetwork MLPs
+    // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/mask_decoder.py#L101
+    const int mask_begin = multimask_output ? 1 : 0;
+    const int n_masks    = multimask_output ? num_mask_tokens - 1 : 1;
 
     // Upscale mask embeddings and predict masks using the mask tokens
     // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/mask_decoder.py#L136
-    keys = ggml_cont(ctx0, ggml_transpose(ctx0, keys));
-    keys = ggml_view_4d(ctx0, keys, srcNE[0], srcNE[1], srcNE[2], srcNE[3], srcNE[0]*keys->nb[0], keys->nb[1], keys->nb[2], 0);
-    // ggml_build_forward_expand(gf, keys);
+    // the upscaling runs directly on the token layout [C, W*H, B], so no transposes are needed in or out of it
     struct ggml_tensor * upscaled_embedding = {};
     {
-        // ConvTranspose2d
-        keys = ggml_conv_transpose_2d_p0(ctx0, dec.output_upscaling_0_w, keys, 2);
-        keys = ggml_add_inplace(ctx0, keys, ggml_repeat(ctx0,
-                                     ggml_reshape_3d(ctx0, dec.output_upscaling_0_b, 1, 1, dec.output_upscaling_0_b->ne[0]),
-                                     keys));
-
-        keys = sam_layer_norm_2d(ctx0, keys, n_img_embd, dec.output_upscaling_1_w, dec.output_upscaling_1_b, hparams.eps);
+        // ConvTranspose2d + LayerNorm2d + GELU activation
+        keys = sam_conv_transpose_2d_k2s2_gelu(ctx0, keys, dec.output_upscaling_0_w_t, dec.output_upscaling_0_b, dec.output_upscaling_1_wb, hparams.eps, srcNE[0], srcNE[1]);
 
-        // GELU activation
-        keys = ggml_gelu_inplace(ctx0, keys);
-
-        // ConvTranspose2d
-        keys = ggml_conv_transpose_2d_p0(ctx0, dec.output_upscaling_3_w, keys, 2);
-        keys = ggml_add_inplace(ctx0, ggml_repeat(ctx0,
-                                ggml_reshape_3d(ctx0, dec.output_upscaling_3_b, 1, 1, dec.output_upscaling_3_b->ne[0]),
-                                keys), keys);
-        // GELU activation
-        keys = ggml_gelu_inplace(ctx0, keys);
-        upscaled_embedding = ggml_reshape_3d(ctx0, keys, keys->ne[0]*keys->ne[1], keys->ne[2], keys->ne[3]);
-        upscaled_embedding = ggml_cont(ctx0, ggml_transpose(ctx0, upscaled_embedding)); // TODO: Shouldn't be needed
+        // ConvTranspose2d + GELU activation
+        upscaled_embedding = sam_conv_transpose_2d_k2s2_gelu(ctx0, keys, dec.output_upscaling_3_w_t, dec.output_upscaling_3_b, nullptr, hparams.eps, 2*srcNE[0], 2*srcNE[1]);
     }
 
-    struct ggml_tensor * hyper_in = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_img_embd/2, num_mask_tokens, mask_tokens_out->ne[2]);
+    // the hypernetwork MLPs of all selected mask tokens run together: the tokens are viewed as [C, B, n_masks] and
+    // every layer is one matmul broadcast over the stacked weights of the n_masks MLPs
+    struct ggml_tensor * hyper_in = ggml_view_3d(ctx0, mask_tokens_out,
+            mask_tokens_out->ne[0], mask_tokens_out->ne[2], n_masks,
+            mask_tokens_out->nb[2], mask_tokens_out->nb[1], mask_begin*mask_tokens_out->nb[1]);
 
-    for (int i = 0; i < num_mask_tokens; ++i) {
-        const auto& mlp = dec.output_hypernet_mlps[i];
-        struct ggml_tensor * in = ggml_view_2d(ctx0, mask_tokens_out, mask_tokens_out->ne[0], mask_tokens_out->ne[2], mask_tokens_out->nb[1], i*mask_tokens_out->nb[1]);
-        struct ggml_tensor * out = sam_decode_mask_mlp_relu_3(in, mlp.w_0, mlp.b_0, mlp.w_1, mlp.b_1, mlp.w_2, mlp.b_2, ctx0);
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, out, ggml_view_2d(ctx0, hyper_in, hyper_in->ne[0], hyper_in->ne[2], hyper_in->nb[1], i*hyper_in->nb[1])));
-    }
+    hyper_in = sam_decode_mask_mlp_relu_3(hyper_in,
+            sam_hypernet_view(ctx0, dec.output_hypernet_w_0, mask_begin, n_masks), sam_hypernet_view(ctx0, dec.output_hypernet_b_0, mask_begin, n_masks),
+            sam_hypernet_view(ctx0, dec.output_hypernet_w_1, mask_begin, n_masks), sam_hypernet_view(ctx0, dec.output_hypernet_b_1, mask_begin, n_masks),
+            sam_hypernet_view(ctx0, dec.output_hypernet_w_2, mask_begin, n_masks), sam_hypernet_view(ctx0, dec.output_hypernet_b_2, mask_begin, n_masks),
+            ctx0);
 
-    struct ggml_tensor * masks = ggml_mul_mat(ctx0, hyper_in, upscaled_embedding);
-    masks = ggml_cont(ctx0, ggml_transpose(ctx0, masks)); // TODO: Shouldn't be needed
-    masks = ggml_reshape_4d(ctx0, masks, keys->ne[0], keys->ne[1], masks->ne[1], keys->ne[3]);
+    // [n_img_embd/2, B, n_masks] -> [n_img_embd/2, n_masks, B], read through the view by the matmul below
+    hyper_in = ggml_permute(ctx0, hyper_in, 0, 2, 1, 3);
+
+    // [W*H, n_masks, B] - the pixels are already the fastest dimension
+    struct ggml_tensor * masks = ggml_mul_mat(ctx0, upscaled_embedding, hyper_in);
+    masks = ggml_reshape_4d(ctx0, masks, 4*srcNE[0], 4*srcNE[1], masks->ne[1], masks->ne[2]);
 
     // Generate mask quality predictions
     // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/mask_decoder.py#L146
     iou_pred = sam_decode_mask_mlp_relu_3(iou_pred, dec.iou_prediction_head_0_w, dec.iou_prediction_head_0_b, dec.iou_prediction_head_1_w, dec.iou_prediction_head_1_b, dec.iou_prediction_head_2_w, dec.iou_prediction_head_2_b, ctx0);
 
-    // Select the correct mask or masks for output
-    // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/mask_decoder.py#L101
-    iou_pred = ggml_cpy(state.ctx_masks, ggml_view_1d(ctx0, iou_pred, iou_pred->ne[0] - 1, iou_pred->nb[0]), state.iou_predictions);
-    masks = ggml_view_4d(ctx0, masks, masks->ne[0], masks->ne[1], masks->ne[2] - 1, masks->ne[3],
-                                      masks->nb[1], masks->nb[2], masks->nb[3], masks->nb[2] /* offset*/);
-    masks = ggml_cpy(state.ctx_masks, masks, state.low_res_masks);
+    iou_pred = ggml_cpy(ctx0, ggml_view_2d(ctx0, iou_pred, n_masks, iou_pred->ne[1], iou_pred->nb[1], mask_begin*iou_pred->nb[0]), state.iou_predictions);
+    masks = ggml_cpy(ctx0, masks, state.low_res_masks);
 
     ggml_build_forward_expand(gf, masks);
     ggml_build_forward_expand(gf, iou_pred);
@@ -1759,16 +2641,28 @@ bool sam_decode_mask(
     return true;
 }
 
+// the decoder output copied out of the graph, so that it can be postprocessed on any thread
+struct sam_masks_raw {
+    int ne0 = 0;
+    int ne1 = 0;
+    int n_masks = 0;
+    int n_batch = 0;
+
+    std::vector<float> low_res_masks;   // [ne0, ne1, n_masks, n_batch]
+    std::vector<float> iou_predictions; // [n_masks, n_batch]
+};
+
 std::vector<sam_image_u8> sam_postprocess_masks(
         const sam_hparams    & hparams,
         int                    nx,
         int                    ny,
-        const sam_ggml_state & state,
+        const sam_masks_raw  & raw,
         int                    mask_on_val,
-        int                    mask_off_val) {
-    if (state.low_res_masks->ne[2] == 0) return {};
-    if (state.low_res_masks->ne[2] != state.iou_predictions->ne[0]) {
-        printf("Error: number of masks (%d) does not match number of iou predictions (%d)\n", (int)state.low_res_masks->ne[2], (int)state.iou_predictions->ne[0]);
+        int                    mask_off_val,
+        int                    i_batch) {
+    if (raw.n_masks == 0) return {};
+    if (i_batch >= raw.n_batch) {
+        printf("Error: batch index (%d) out of range (%d)\n", i_batch, raw.n_batch);
         return {};
     }
 
@@ -1779,9 +2673,9 @@ std::vector<sam_image_u8> sam_postprocess_masks(
     const float intersection_threshold = mask_threshold + hparams.stability_score_offset;
     const float union_threshold = mask_threshold - hparams.stability_score_offset;
 
-    const int ne0 = state.low_res_masks->ne[0];
-    const int ne1 = state.low_res_masks->ne[1];
-    const int ne2 = state.low_res_masks->ne[2];
+    const int ne0 = raw.ne0;
+    const int ne1 = raw.ne1;
+    const int ne2 = raw.n_masks;
 
     // Remove padding and upscale masks to the original image size.
     // ref: https://github.com/facebookresearch/segment-anything/blob/efeab7296ab579d4a261e554eca80faf6b33924a/segment_anything/modeling/sam.py#L140
@@ -1796,7 +2690,7 @@ std::vector<sam_image_u8> sam_postprocess_masks(
     const float scale_x_2 = float(cropped_nx) / float(nx);
     const float scale_y_2 = float(cropped_ny) / float(ny);
 
-    const auto iou_data = (float*)state.iou_predictions->data;
+    const float * iou_data = raw.iou_predictions.data() + i_batch*ne2;
 
     std::map<float, sam_image_u8, std::greater<float>> res_map;
     for (int i = 0; i < ne2; ++i) {
@@ -1807,7 +2701,7 @@ std::vector<sam_image_u8> sam_postprocess_masks(
 
         std::vector<float> mask_data(n_img_size*n_img_size);
         {
-            const float* data = (float *) state.low_res_masks->data + i*ne0*ne1;
+            const float* data = raw.low_res_masks.data() + (i_batch*ne2 + i)*ne0*ne1;
 
             for (int iy = 0; iy < n_img_size; ++iy) {
                 for (int ix = 0; ix < n_img_size; ++ix) {
@@ -1929,11 +2823,12 @@ struct ggml_cgraph  * sam_build_fast_graph(
                   sam_ggml_state & state,
                         int   nx,
                         int   ny,
-                  sam_point   point) {
+        const std::vector<sam_point> & points,
+        const std::vector<float>     & mask_input,
+                       bool   multimask_output) {
 
     // since we are using ggml-alloc, this buffer only needs enough space to hold the ggml_tensor and ggml_cgraph structs, but not the tensor data
-    static size_t buf_size = ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead();
-    static std::vector<uint8_t> buf(buf_size);
+    auto & buf = state.buf_compute_meta;
 
     struct ggml_init_params ggml_params = {
         /*.mem_size   =*/ buf.size(),
@@ -1944,19 +2839,19 @@ struct ggml_cgraph  * sam_build_fast_graph(
     struct ggml_context * ctx0   = ggml_init(ggml_params);
     struct ggml_cgraph  * gf     = ggml_new_graph(ctx0);
 
-    prompt_encoder_result enc_res = sam_encode_prompt(model, ctx0, gf, state, nx, ny, point);
+    prompt_encoder_result enc_res = sam_encode_prompt(model, ctx0, gf, state, nx, ny, points, mask_input);
     if (!enc_res.embd_prompt_sparse || !enc_res.embd_prompt_dense) {
         fprintf(stderr, "%s: failed to encode prompt\n", __func__);
         return {};
     }
 
-    struct ggml_tensor * pe_img_dense = sam_fill_dense_pe(model, ctx0, gf, state);
+    struct ggml_tensor * pe_img_dense = state.pe_img ? state.pe_img : sam_fill_dense_pe(model, ctx0, gf, state);
     if (!pe_img_dense) {
         fprintf(stderr, "%s: failed to get dense positional encoding\n", __func__);
         return {};
     }
 
-    if (!sam_decode_mask(model, enc_res, pe_img_dense, ctx0, gf, state)) {
+    if (!sam_decode_mask(model, enc_res, pe_img_dense, ctx0, gf, state, multimask_output)) {
          fprintf(stderr, "%s: failed to decode mask\n", __func__);
          return {};
     }
@@ -1966,194 +2861,1430 @@ struct ggml_cgraph  * sam_build_fast_graph(
     return gf;
 }
 
-std::shared_ptr<sam_state> sam_load_model(const sam_params & params) {
-    ggml_time_init();
-    const int64_t t_start_ms = ggml_time_ms();
-
-    sam_state state;
-    state.model = std::make_unique<sam_ggml_model>();
-    state.state = std::make_unique<sam_ggml_state>();
-    if (!sam_ggml_model_load(params.model, *state.model)) {
-        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
-        return {};
-    }
+// precompute the decoder inputs that depend only on the image embedding:
+//
+// - the dense positional encoding of the image
+// - the keys and values of the first token-to-image cross attention layer
+//
+// with these cached, each sam_compute_masks call only runs the token-dependent part of the first layer
+struct ggml_cgraph * sam_build_dec_img_cache_graph(
+        const sam_ggml_model & model,
+              sam_ggml_state & state) {
 
-    state.t_load_ms = ggml_time_ms() - t_start_ms;
+    // since we are using ggml-alloc, this buffer only needs enough space to hold the ggml_tensor and ggml_cgraph structs, but not the tensor data
+    auto & buf = state.buf_compute_meta;
 
-    return std::make_unique<sam_state>(std::move(state));
-}
+    struct ggml_init_params ggml_params = {
+        /*.mem_size   =*/ buf.size(),
+        /*.mem_buffer =*/ buf.data(),
+        /*.no_alloc   =*/ true, // skip allocating as we use ggml_alloc to allocate exact memory requirements
+    };
 
-bool sam_compute_embd_img(const sam_image_u8 & img, int n_threads, sam_state & state) {
-    if (!state.model || !state.state) {
-        return false;
-    }
+    struct ggml_context * ctx0   = ggml_init(ggml_params);
+    struct ggml_cgraph  * gf     = ggml_new_graph(ctx0);
 
-    const int64_t t_start_ms = ggml_time_ms();
+    const auto & attn = model.dec.transformer_layers[0].cross_attn_token_to_img;
 
-    // preprocess to f32
-    sam_image_f32 img1;
-    if (!sam_image_preprocess(img, img1)) {
-        fprintf(stderr, "%s: failed to preprocess image\n", __func__);
-        return false;
-    }
+    struct ggml_tensor * pe_img = sam_fill_dense_pe(model, ctx0, gf, state);
 
-    fprintf(stderr, "%s: preprocessed image (%d x %d)\n", __func__, img1.nx, img1.ny);
+    // same as the keys and pos_src in sam_decode_mask for a prompt without a mask
+    struct ggml_tensor * keys = ggml_add(ctx0, sam_embd_img_f32(ctx0, state), model.enc_prompt.no_mask_embd_w);
 
-    static const size_t buf_size = 256u*1024*1024;
+    struct ggml_tensor * pos_src = ggml_reshape_2d(ctx0, pe_img, pe_img->ne[0], pe_img->ne[1]*pe_img->ne[2]);
 
-    auto& st = *state.state;
-    auto& model = *state.model;
+    struct ggml_tensor * K = sam_decode_mask_transformer_attn_k(attn, ggml_add(ctx0, keys, pos_src), ctx0, model);
+    struct ggml_tensor * V = sam_decode_mask_transformer_attn_v(attn, keys, ctx0, model);
 
-    if (st.ctx_img) {
-        ggml_free(st.ctx_img);
-        st.ctx_img = {};
-    }
+    ggml_build_forward_expand(gf, ggml_cpy(ctx0, pe_img, state.pe_img));
+    ggml_build_forward_expand(gf, ggml_cpy(ctx0, K, state.dec_k0));
+    ggml_build_forward_expand(gf, ggml_cpy(ctx0, V, state.dec_v0));
 
-    struct ggml_init_params ggml_params = {
-        /*.mem_size   =*/ buf_size,
-        /*.mem_buffer =*/ NULL,
-        /*.no_alloc   =*/ false,
-    };
+    ggml_disconnect_node_from_graph(state.pe_img);
+    ggml_disconnect_node_from_graph(state.dec_k0);
+    ggml_disconnect_node_from_graph(state.dec_v0);
 
-    st.ctx_img = ggml_init(ggml_params);
+    ggml_free(ctx0);
 
-    st.embd_img = ggml_new_tensor_3d(st.ctx_img, GGML_TYPE_F32,
-            model.hparams.n_img_embd(), model.hparams.n_img_embd(), model.hparams.n_enc_out_chans);
+    return gf;
+}
 
-    // Encode the image
-    const size_t alignment = ggml_backend_get_alignment(model.backend);
+// build the graph once to measure the memory it needs, then build it again with an exactly sized allocator and compute it
+// keep_buffer: compute in st.buf_compute and keep it for the next graphs, otherwise the buffer is freed on return
+static bool sam_ggml_graph_compute(
+              sam_ggml_state & st,
+                         int   n_threads,
+                        bool   keep_buffer,
+        const std::function<struct ggml_cgraph * ()> & build_graph) {
+    const size_t alignment = ggml_backend_get_alignment(st.backend);
     st.allocr = ggml_allocr_new_measure(alignment);
 
-    struct ggml_cgraph * gf_measure = sam_encode_image(model, st, img1);
+    // measure memory requirements for the graph
+    struct ggml_cgraph * gf_measure = build_graph();
     if (!gf_measure) {
-        fprintf(stderr, "%s: failed to encode image\n", __func__);
+        ggml_allocr_free(st.allocr);
+        st.allocr = {};
         return false;
     }
 
     size_t alloc_size = ggml_allocr_alloc_graph(st.allocr, gf_measure);
     ggml_allocr_free(st.allocr);
 
+    st.mem_graph_compute = alloc_size;
+
+    // the decoder graphs are small and computed for every prompt, so their buffer is reused
+    // the encoder needs hundreds of MB once per image - that buffer is released as soon as the graph is computed
+    ggml_backend_buffer_t buf = {};
+    if (keep_buffer) {
+        if (!st.buf_compute || ggml_backend_buffer_get_size(st.buf_compute) < alloc_size) {
+            if (st.buf_compute) {
+                ggml_backend_buffer_free(st.buf_compute);
+            }
+            st.buf_compute = ggml_backend_alloc_buffer(st.backend, alloc_size);
+        }
+        buf = st.buf_compute;
+    } else {
+        buf = ggml_backend_alloc_buffer(st.backend, alloc_size);
+    }
+
     // recreate allocator with exact memory requirements
-    ggml_backend_buffer_t buf_compute = ggml_backend_alloc_buffer(model.backend, alloc_size);
-    st.allocr = ggml_allocr_new_from_buffer(buf_compute);
+    st.allocr = ggml_allocr_new_from_buffer(buf);
 
     // compute the graph with the measured exact memory requirements from above
     ggml_allocr_reset(st.allocr);
 
-    struct ggml_cgraph  * gf = sam_encode_image(model, st, img1);
-    if (!gf) {
-        fprintf(stderr, "%s: failed to encode image\n", __func__);
-        return false;
-    }
+    struct ggml_cgraph * gf = build_graph();
+    if (gf) {
+        ggml_allocr_alloc_graph(st.allocr, gf);
+
+        const int64_t t_start_us = ggml_time_us();
 
-    ggml_allocr_alloc_graph(st.allocr, gf);
+        ggml_graph_compute_helper(st.backend, gf, n_threads);
 
-    ggml_graph_compute_helper(model.backend, gf, n_threads);
+        st.t_graph_compute_us = ggml_time_us() - t_start_us;
+    }
 
     ggml_allocr_free(st.allocr);
-    ggml_backend_buffer_free(buf_compute);
 
     st.allocr = {};
 
-    state.t_compute_img_ms = ggml_time_ms() - t_start_ms;
+    if (!keep_buffer) {
+        ggml_backend_buffer_free(buf);
+    }
+
+    return gf != nullptr;
+}
+
+static bool sam_ggml_state_init(sam_ggml_state & st) {
+    st.backend = ggml_backend_cpu_init();
+    if (!st.backend) {
+        fprintf(stderr, "%s: ggml_backend_cpu_init() failed\n", __func__);
+        return false;
+    }
+
+    st.buf_compute_meta.resize(ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead());
 
     return true;
 }
 
-std::vector<sam_image_u8> sam_compute_masks(
-        const sam_image_u8 & img,
-        int                  n_threads,
-        sam_point            pt,
-        sam_state          & state,
-        int                  mask_on_val,
-        int                  mask_off_val) {
-    if (!state.model || !state.state) {
-        return {};
+// read the thread counts for this model and machine from the autotune cache
+static bool sam_autotune_load(const std::string & fname, const std::string & key, int & n_threads_enc, int & n_threads_dec) {
+    std::ifstream fin(fname);
+    if (!fin) {
+        return false;
     }
 
-    const int64_t t_start_ms = ggml_time_ms();
+    std::string line_key;
+    int enc = 0;
+    int dec = 0;
+    while (fin >> line_key >> enc >> dec) {
+        if (line_key == key && enc > 0 && dec > 0) {
+            n_threads_enc = enc;
+            n_threads_dec = dec;
+            return true;
+        }
+    }
 
-    static size_t buf_size = 256u*1024*1024;
+    return false;
+}
 
-    struct ggml_init_params ggml_params = {
-        /*.mem_size   =*/ buf_size,
-        /*.mem_buffer =*/ NULL,
-        /*.no_alloc   =*/ false,
-    };
+static void sam_autotune_save(const std::string & fname, const std::string & key, int n_threads_enc, int n_threads_dec) {
+    std::ofstream fout(fname, std::ios::app);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname.c_str());
+        return;
+    }
 
-    auto& st = *state.state;
-    auto& model = *state.model;
+    fout << key << " " << n_threads_enc << " " << n_threads_dec << "\n";
+}
 
-    st.ctx_masks = ggml_init(ggml_params);
+// pick the thread counts of the encoder and the decoder separately by timing them on a synthetic image
+// the decoder graphs are small, so they usually run best with fewer threads than the encoder
+static bool sam_compute_masks_raw(
+        int                            nx,
+        int                            ny,
+        int                            n_threads,
+        const std::vector<sam_point> & points,
+        const std::vector<float>     & mask_input,
+        sam_state                    & state,
+        bool                           multimask_output,
+        sam_masks_raw                & raw);
+
+static void sam_autotune(sam_state & state, const sam_params & params) {
+    const auto & hparams = state.model->hparams;
+
+    const int n_hw = std::max(1, (int) std::thread::hardware_concurrency());
+
+    // the profile depends on the model size, the encoder output and activation types and the machine
+    const std::string key =
+        "enc_state="   + std::to_string(hparams.n_enc_state) +
+        ",embd_type="  + std::to_string((int) params.embd_type) +
+        ",f16_act="    + std::to_string((int) params.f16_activations) +
+        ",hw_threads=" + std::to_string(n_hw);
+
+    // by default, the cache is stored next to the model
+    const std::string fname_cache = params.autotune_cache.empty() ? params.model + ".autotune" : params.autotune_cache;
+
+    if (sam_autotune_load(fname_cache, key, state.n_threads_enc, state.n_threads_dec)) {
+        fprintf(stderr, "%s: using cached thread counts: encoder = %d, decoder = %d\n", __func__, state.n_threads_enc, state.n_threads_dec);
+        return;
+    }
 
-    st.low_res_masks = ggml_new_tensor_3d(st.ctx_masks, GGML_TYPE_F32,
-            model.hparams.n_enc_out_chans, model.hparams.n_enc_out_chans, 3);
+    state.n_threads_enc = 0;
+    state.n_threads_dec = 0;
 
-    st.iou_predictions = ggml_new_tensor_1d(st.ctx_masks, GGML_TYPE_F32, 3);
+    sam_image_u8 img;
+    img.nx = hparams.n_img_size();
+    img.ny = hparams.n_img_size();
+    img.data.resize(3*img.nx*img.ny);
+    for (size_t i = 0; i < img.data.size(); ++i) {
+        img.data[i] = (uint8_t) ((i*2654435761u) >> 24);
+    }
 
+    // a full encoder run takes seconds, so only the upper part of the range is tried for it
+    std::vector<int> candidates_enc;
+    for (int n : { n_hw/4, n_hw/2, (3*n_hw)/4, n_hw }) {
+        if (n > 0 && (candidates_enc.empty() || candidates_enc.back() != n)) {
+            candidates_enc.push_back(n);
+        }
+    }
 
-    const size_t alignment = ggml_backend_get_alignment(model.backend);
-    st.allocr = ggml_allocr_new_measure(alignment);
+    std::vector<int> candidates_dec;
+    for (int n = 1; n < n_hw; n *= 2) {
+        candidates_dec.push_back(n);
+    }
+    candidates_dec.push_back(n_hw);
+
+    int64_t t_best = -1;
+    int n_best_enc = n_hw;
+    for (int n : candidates_enc) {
+        const int64_t t_start_us = ggml_time_us();
+        if (!sam_compute_embd_img(img, n, state)) {
+            fprintf(stderr, "%s: failed to encode the benchmark image\n", __func__);
+            return;
+        }
+        const int64_t t = ggml_time_us() - t_start_us;
+        fprintf(stderr, "%s: encoder with %2d threads: %8.2f ms\n", __func__, n, t/1000.0);
+        if (t_best < 0 || t < t_best) {
+            t_best = t;
+            n_best_enc = n;
+        }
+    }
 
-    // measure memory requirements for the graph
-    struct ggml_cgraph  * gf_measure = sam_build_fast_graph(model, st, img.nx, img.ny, pt);
-    if (!gf_measure) {
-        fprintf(stderr, "%s: failed to build fast graph to measure\n", __func__);
-        return {};
+    const sam_point pt = { img.nx/2.0f, img.ny/2.0f };
+    const int n_iter = 3;
+
+    // only the decoder graph is timed - the postprocessing of the masks is single-threaded
+    t_best = -1;
+    int n_best_dec = n_hw;
+    for (int n : candidates_dec) {
+        int64_t t_min = -1;
+        for (int it = 0; it < n_iter; ++it) {
+            sam_masks_raw raw;
+            if (!sam_compute_masks_raw(img.nx, img.ny, n, { pt }, {}, state, true, raw)) {
+                fprintf(stderr, "%s: failed to decode the benchmark prompt\n", __func__);
+                break;
+            }
+            const int64_t t = state.state->t_graph_compute_us;
+            t_min = t_min < 0 ? t : std::min(t_min, t);
+        }
+        if (t_min < 0) {
+            break;
+        }
+        fprintf(stderr, "%s: decoder with %2d threads: %8.2f ms\n", __func__, n, t_min/1000.0);
+        if (t_best < 0 || t_min < t_best) {
+            t_best = t_min;
+            n_best_dec = n;
+        }
     }
 
-    size_t alloc_size = ggml_allocr_alloc_graph(st.allocr, gf_measure);
-    ggml_allocr_free(st.allocr);
+    // drop the embedding of the benchmark image, so that decoding before the first real image fails instead of
+    // returning masks of the benchmark image
+    auto & st = *state.state;
+    st.embd_img = {};
+    st.pe_img   = {};
+    st.dec_k0   = {};
+    st.dec_v0   = {};
 
-    // recreate allocator with exact memory requirements
-    ggml_backend_buffer_t buf_compute = ggml_backend_alloc_buffer(model.backend, alloc_size);
-    st.allocr = ggml_allocr_new_from_buffer(buf_compute);
+    state.n_threads_enc = n_best_enc;
+    state.n_threads_dec = n_best_dec;
 
-    // compute the graph with the measured exact memory requirements from above
-    ggml_allocr_reset(st.allocr);
+    fprintf(stderr, "%s: selected thread counts: encoder = %d, decoder = %d\n", __func__, state.n_threads_enc, state.n_threads_dec);
 
-    struct ggml_cgraph  * gf = sam_build_fast_graph(model, st, img.nx, img.ny, pt);
-    if (!gf) {
-        fprintf(stderr, "%s: failed to build fast graph\n", __func__);
+    sam_autotune_save(fname_cache, key, state.n_threads_enc, state.n_threads_dec);
+}
+
+std::shared_ptr<sam_state> sam_load_model(const sam_params & params) {
+    ggml_time_init();
+    const int64_t t_start_ms = ggml_time_ms();
+
+    auto model = std::make_shared<sam_ggml_model>();
+    if (!sam_ggml_model_load(params.model, *model)) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
         return {};
     }
 
-    ggml_allocr_alloc_graph(st.allocr, gf);
+    sam_state state;
+    state.model = std::move(model);
+    state.state = std::make_unique<sam_ggml_state>();
 
-    ggml_graph_compute_helper(model.backend, gf, n_threads);
+    if (!sam_ggml_state_init(*state.state)) {
+        return {};
+    }
 
-    //print_t_f32("iou_predictions", st.iou_predictions);
-    //print_t_f32("low_res_masks", st.low_res_masks);
+    state.state->precompute_dec_kv = params.precompute_dec_kv;
 
-    std::vector<sam_image_u8> masks = sam_postprocess_masks(model.hparams, img.nx, img.ny, st, mask_on_val, mask_off_val);
+    switch (params.embd_type) {
+        case SAM_EMBD_TYPE_F32: state.state->embd_type = GGML_TYPE_F32; break;
+        case SAM_EMBD_TYPE_F16: state.state->embd_type = GGML_TYPE_F16; break;
+        case SAM_EMBD_TYPE_I8:  state.state->embd_type = GGML_TYPE_I8;  break;
+    }
+
+    // with BLAS the large matrix multiplications are done by sgemm, which converts F16 operands back to F32
+    state.state->f16_act = params.f16_activations && !ggml_cpu_has_blas();
+    if (params.f16_activations && !state.state->f16_act) {
+        fprintf(stderr, "%s: F16 activations are not supported with BLAS, using F32\n", __func__);
+    }
+
+    state.t_load_ms = ggml_time_ms() - t_start_ms;
+
+    if (params.autotune) {
+        sam_autotune(state, params);
+    }
+
+    return std::make_unique<sam_state>(std::move(state));
+}
+
+std::shared_ptr<sam_state> sam_new_session(const sam_state & state) {
+    if (!state.model || !state.state) {
+        return {};
+    }
+
+    auto session = std::make_shared<sam_state>();
+    session->model = state.model;
+    session->state = std::make_unique<sam_ggml_state>();
+    if (!sam_ggml_state_init(*session->state)) {
+        return {};
+    }
+
+    session->state->precompute_dec_kv = state.state->precompute_dec_kv;
+    session->state->embd_type = state.state->embd_type;
+    session->state->f16_act = state.state->f16_act;
+    session->t_load_ms = state.t_load_ms;
+    session->n_threads_enc = state.n_threads_enc;
+    session->n_threads_dec = state.n_threads_dec;
+
+    return session;
+}
+
+static bool sam_compute_embd_img_f32(const sam_image_f32 & img1, int n_threads, sam_state & state);
+
+bool sam_compute_embd_img(const sam_image_u8 & img, int n_threads, sam_state & state) {
+    return sam_compute_embd_img(sam_image_view_from_u8(img), n_threads, state);
+}
+
+bool sam_compute_embd_img(const sam_image_view & img, int n_threads, sam_state & state) {
+    if (!state.model || !state.state) {
+        return false;
+    }
+
+    const int64_t t_start_ms = ggml_time_ms();
+
+    // preprocess to f32
+    sam_image_f32 img1;
+    if (!sam_image_preprocess(img, img1)) {
+        fprintf(stderr, "%s: failed to preprocess image\n", __func__);
+        return false;
+    }
+
+    fprintf(stderr, "%s: preprocessed image (%d x %d)\n", __func__, img1.nx, img1.ny);
+
+    if (!sam_compute_embd_img_f32(img1, n_threads, state)) {
+        return false;
+    }
+
+    state.t_compute_img_ms = ggml_time_ms() - t_start_ms;
+
+    return true;
+}
+
+// allocate the tensors of a no_alloc context in buf
+// the buffer is kept between calls and only reallocated when the tensors do not fit in it
+static void sam_alloc_tensors(
+        ggml_backend_t                            backend,
+        const std::vector<struct ggml_tensor *> & tensors,
+        ggml_backend_buffer_t                   & buf) {
+    const size_t alignment = ggml_backend_get_alignment(backend);
+
+    size_t buf_size = 0;
+    for (const auto * t : tensors) {
+        buf_size += GGML_PAD(ggml_nbytes(t), alignment);
+    }
+
+    if (!buf || ggml_backend_buffer_get_size(buf) < buf_size) {
+        if (buf) {
+            ggml_backend_buffer_free(buf);
+        }
+        buf = ggml_backend_alloc_buffer(backend, buf_size);
+    }
+
+    ggml_allocr * alloc = ggml_allocr_new_from_buffer(buf);
+    for (auto * t : tensors) {
+        ggml_allocr_alloc(alloc, t);
+    }
+    ggml_allocr_free(alloc);
+}
+
+// encode an already preprocessed image
+// prepare the tensors that hold the image embedding and the decoder inputs derived from it
+// they have the same shape for every image, so they are allocated once per session
+static void sam_init_embd_img(const sam_ggml_model & model, sam_ggml_state & st) {
+    if (!st.ctx_img) {
+        const auto & hparams = model.hparams;
+
+        const int32_t n_img_embd      = hparams.n_img_embd();
+        const int32_t n_enc_out_chans = hparams.n_enc_out_chans;
+        const int32_t n_dec_heads     = hparams.n_dec_heads;
+
+        // the token-to-image attention projects to half of the channels
+        const int32_t n_dec_embd_head = (n_enc_out_chans/2)/n_dec_heads;
+
+        struct ggml_init_params ggml_params = {
+            /*.mem_size   =*/ 5*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+
+        st.ctx_img = ggml_init(ggml_params);
+
+        std::vector<struct ggml_tensor *> tensors;
+
+        tensors.push_back(ggml_new_tensor_3d(st.ctx_img, st.embd_type, n_enc_out_chans, n_img_embd, n_img_embd));
+        ggml_set_name(tensors.back(), "embd_img");
+
+        if (st.embd_type == GGML_TYPE_I8) {
+            tensors.push_back(ggml_new_tensor_1d(st.ctx_img, GGML_TYPE_F32, n_enc_out_chans));
+            ggml_set_name(tensors.back(), "embd_img_scale");
+        }
+
+        if (st.precompute_dec_kv) {
+            tensors.push_back(ggml_new_tensor_3d(st.ctx_img, GGML_TYPE_F32, n_enc_out_chans, n_img_embd, n_img_embd));
+            ggml_set_name(tensors.back(), "pe_img");
+
+            tensors.push_back(ggml_new_tensor_3d(st.ctx_img, GGML_TYPE_F32, n_dec_embd_head, n_img_embd*n_img_embd, n_dec_heads));
+            ggml_set_name(tensors.back(), "dec_k0");
+
+            tensors.push_back(ggml_new_tensor_3d(st.ctx_img, GGML_TYPE_F32, n_img_embd*n_img_embd, n_dec_embd_head, n_dec_heads));
+            ggml_set_name(tensors.back(), "dec_v0");
+        }
+
+        sam_alloc_tensors(st.backend, tensors, st.buf_img);
+    }
+
+    st.embd_img       = ggml_get_tensor(st.ctx_img, "embd_img");
+    st.embd_img_scale = ggml_get_tensor(st.ctx_img, "embd_img_scale");
+
+    st.pe_img = {};
+    st.dec_k0 = {};
+    st.dec_v0 = {};
+}
+
+// compute the decoder inputs that depend only on the image embedding, see sam_build_dec_img_cache_graph
+static void sam_compute_dec_img_cache(const sam_ggml_model & model, sam_ggml_state & st, int n_threads) {
+    if (!st.precompute_dec_kv) {
+        return;
+    }
+
+    st.pe_img = ggml_get_tensor(st.ctx_img, "pe_img");
+    st.dec_k0 = ggml_get_tensor(st.ctx_img, "dec_k0");
+    st.dec_v0 = ggml_get_tensor(st.ctx_img, "dec_v0");
+
+    if (!sam_ggml_graph_compute(st, n_threads, true, [&]() { return sam_build_dec_img_cache_graph(model, st); })) {
+        fprintf(stderr, "%s: failed to precompute the decoder image inputs\n", __func__);
+        st.pe_img = {};
+        st.dec_k0 = {};
+        st.dec_v0 = {};
+    }
+}
+
+static bool sam_compute_embd_img_f32(const sam_image_f32 & img1, int n_threads, sam_state & state) {
+    if (!state.model || !state.state) {
+        return false;
+    }
+
+    if (state.n_threads_enc > 0) {
+        n_threads = state.n_threads_enc;
+    }
+
+    auto& st = *state.state;
+    const auto& model = *state.model;
+
+    sam_init_embd_img(model, st);
+
+    // Encode the image
+    if (!sam_ggml_graph_compute(st, n_threads, false, [&]() { return sam_encode_image(model, st, img1); })) {
+        fprintf(stderr, "%s: failed to encode image\n", __func__);
+        st.embd_img = {};
+        return false;
+    }
+
+    sam_compute_dec_img_cache(model, st, n_threads);
+
+    return true;
+}
+
+std::vector<uint8_t> sam_get_embd_img(const sam_state & state) {
+    if (!state.state || !state.state->embd_img) {
+        return {};
+    }
+
+    const auto & st = *state.state;
+
+    // the raw embd_img data, followed by the per-channel scales for int8
+    const size_t n_embd  = ggml_nbytes(st.embd_img);
+    const size_t n_scale = st.embd_img_scale ? ggml_nbytes(st.embd_img_scale) : 0;
+
+    std::vector<uint8_t> embd(n_embd + n_scale);
+
+    memcpy(embd.data(), st.embd_img->data, n_embd);
+    if (n_scale > 0) {
+        memcpy(embd.data() + n_embd, st.embd_img_scale->data, n_scale);
+    }
+
+    return embd;
+}
+
+bool sam_set_embd_img(const std::vector<uint8_t> & embd, int n_threads, sam_state & state) {
+    if (!state.model || !state.state) {
+        return false;
+    }
+
+    auto& st = *state.state;
+    const auto& model = *state.model;
+
+    sam_init_embd_img(model, st);
+
+    const size_t n_embd  = ggml_nbytes(st.embd_img);
+    const size_t n_scale = st.embd_img_scale ? ggml_nbytes(st.embd_img_scale) : 0;
+
+    if (embd.size() != n_embd + n_scale) {
+        fprintf(stderr, "%s: embedding size mismatch: got %zu bytes, expected %zu\n", __func__, embd.size(), n_embd + n_scale);
+        st.embd_img = {};
+        return false;
+    }
+
+    memcpy(st.embd_img->data, embd.data(), n_embd);
+    if (n_scale > 0) {
+        memcpy(st.embd_img_scale->data, embd.data() + n_embd, n_scale);
+    }
+
+    sam_compute_dec_img_cache(model, st, state.n_threads_enc > 0 ? state.n_threads_enc : n_threads);
+
+    return true;
+}
+
+// run the prompt encoder and mask decoder for a batch of points and copy out the raw output
+static bool sam_compute_masks_raw(
+        int                            nx,
+        int                            ny,
+        int                            n_threads,
+        const std::vector<sam_point> & points,
+        const std::vector<float>     & mask_input,
+        sam_state                    & state,
+        bool                           multimask_output,
+        sam_masks_raw                & raw) {
+    if (!state.model || !state.state || !state.state->embd_img || points.empty()) {
+        return false;
+    }
+
+    if (state.n_threads_dec > 0) {
+        n_threads = state.n_threads_dec;
+    }
+
+    struct ggml_init_params ggml_params = {
+        /*.mem_size   =*/ 2*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    auto& st = *state.state;
+    const auto& model = *state.model;
+
+    st.ctx_masks = ggml_init(ggml_params);
+
+    const int n_masks  = multimask_output ? 3 : 1;
+    const int n_points = (int) points.size();
+
+    st.low_res_masks = ggml_new_tensor_4d(st.ctx_masks, GGML_TYPE_F32,
+            model.hparams.n_enc_out_chans, model.hparams.n_enc_out_chans, n_masks, n_points);
+
+    st.iou_predictions = ggml_new_tensor_2d(st.ctx_masks, GGML_TYPE_F32, n_masks, n_points);
+
+    sam_alloc_tensors(st.backend, { st.low_res_masks, st.iou_predictions }, st.buf_masks);
+
+    const bool ok = sam_ggml_graph_compute(st, n_threads, true, [&]() { return sam_build_fast_graph(model, st, nx, ny, points, mask_input, multimask_output); });
+    if (!ok) {
+        fprintf(stderr, "%s: failed to build fast graph\n", __func__);
+    } else {
+        //print_t_f32("iou_predictions", st.iou_predictions);
+        //print_t_f32("low_res_masks", st.low_res_masks);
+
+        state.mem_compute_masks        = st.mem_graph_compute;
+        state.t_compute_masks_graph_us = st.t_graph_compute_us;
+
+        raw.ne0     = (int) st.low_res_masks->ne[0];
+        raw.ne1     = (int) st.low_res_masks->ne[1];
+        raw.n_masks = n_masks;
+        raw.n_batch = n_points;
+
+        const float * masks_data = (const float *) st.low_res_masks->data;
+        const float * iou_data   = (const float *) st.iou_predictions->data;
+
+        raw.low_res_masks.assign(masks_data, masks_data + ggml_nelements(st.low_res_masks));
+        raw.iou_predictions.assign(iou_data, iou_data + ggml_nelements(st.iou_predictions));
+    }
 
-    ggml_allocr_free(st.allocr);
     ggml_free(st.ctx_masks);
-    ggml_backend_buffer_free(buf_compute);
 
-    st.allocr = {};
     st.ctx_masks = {};
     st.low_res_masks = {};
     st.iou_predictions = {};
 
+    return ok;
+}
+
+std::vector<std::vector<sam_image_u8>> sam_compute_masks_batch(
+        int                            nx,
+        int                            ny,
+        int                            n_threads,
+        const std::vector<sam_point> & points,
+        sam_state                    & state,
+        int                            mask_on_val,
+        int                            mask_off_val,
+        bool                           multimask_output) {
+    const int64_t t_start_ms = ggml_time_ms();
+
+    sam_masks_raw raw;
+    if (!sam_compute_masks_raw(nx, ny, n_threads, points, {}, state, multimask_output, raw)) {
+        return {};
+    }
+
+    std::vector<std::vector<sam_image_u8>> masks(raw.n_batch);
+    for (int i = 0; i < raw.n_batch; ++i) {
+        masks[i] = sam_postprocess_masks(state.model->hparams, nx, ny, raw, mask_on_val, mask_off_val, i);
+    }
+
     state.t_compute_masks_ms = ggml_time_ms() - t_start_ms;
 
     return masks;
 }
 
+std::vector<sam_image_u8> sam_compute_masks(
+        const sam_image_u8 & img,
+        int                  n_threads,
+        sam_point            pt,
+        sam_state          & state,
+        int                  mask_on_val,
+        int                  mask_off_val,
+        bool                 multimask_output) {
+    auto masks = sam_compute_masks_batch(img.nx, img.ny, n_threads, { pt }, state, mask_on_val, mask_off_val, multimask_output);
+    if (masks.empty()) {
+        return {};
+    }
+
+    return std::move(masks[0]);
+}
+
 void sam_deinit(sam_state & state) {
-    if (state.state) {
-        if (state.state->ctx_img) {
-            ggml_free(state.state->ctx_img);
+    // the model is released together with the last session that uses it
+    state.state.reset();
+    state.model.reset();
+}
+
+struct sam_async_request {
+    bool is_embd = false;
+
+    // embd
+    sam_image_u8 img;
+    std::promise<bool> res_embd;
+
+    // masks
+    int nx = 0;
+    int ny = 0;
+    sam_point pt;
+    int mask_on_val = 255;
+    int mask_off_val = 0;
+    bool multimask_output = true;
+    std::promise<std::vector<sam_image_u8>> res_masks;
+};
+
+struct sam_async {
+    std::shared_ptr<sam_state> state;
+    int n_threads = 1;
+
+    // size of the last submitted image - used by the mask requests that follow it
+    int nx = 0;
+    int ny = 0;
+
+    bool stop = false;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<sam_async_request> queue;
+
+    std::thread worker;
+
+    ~sam_async() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_one();
+
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+};
+
+// upper limit for the number of prompts decoded in one graph
+static const int SAM_ASYNC_MAX_BATCH = 16;
+
+static void sam_async_worker(sam_async & async) {
+    while (true) {
+        std::vector<sam_async_request> batch;
+        {
+            std::unique_lock<std::mutex> lock(async.mutex);
+            async.cv.wait(lock, [&]() { return async.stop || !async.queue.empty(); });
+
+            // drain the queue before stopping, so that every returned future is resolved
+            if (async.queue.empty()) {
+                return;
+            }
+
+            batch.push_back(std::move(async.queue.front()));
+            async.queue.pop_front();
+
+            // coalesce the consecutive mask requests for the same image that produce the same number of masks
+            if (!batch[0].is_embd) {
+                while (!async.queue.empty() && (int) batch.size() < SAM_ASYNC_MAX_BATCH) {
+                    const auto & next = async.queue.front();
+                    if (next.is_embd || next.multimask_output != batch[0].multimask_output) {
+                        break;
+                    }
+                    batch.push_back(std::move(async.queue.front()));
+                    async.queue.pop_front();
+                }
+            }
+        }
+
+        if (batch[0].is_embd) {
+            batch[0].res_embd.set_value(sam_compute_embd_img(batch[0].img, async.n_threads, *async.state));
+            continue;
+        }
+
+        std::vector<sam_point> points;
+        for (const auto & req : batch) {
+            points.push_back(req.pt);
+        }
+
+        // the masks are generated as on/off = 1/0 and mapped to the requested values per request
+        auto masks = sam_compute_masks_batch(batch[0].nx, batch[0].ny, async.n_threads, points, *async.state, 1, 0, batch[0].multimask_output);
+
+        for (int i = 0; i < (int) batch.size(); ++i) {
+            auto & req = batch[i];
+            if (i >= (int) masks.size()) {
+                req.res_masks.set_value({});
+                continue;
+            }
+
+            for (auto & mask : masks[i]) {
+                for (auto & v : mask.data) {
+                    v = v ? req.mask_on_val : req.mask_off_val;
+                }
+            }
+            req.res_masks.set_value(std::move(masks[i]));
+        }
+    }
+}
+
+std::shared_ptr<sam_async> sam_async_init(
+        std::shared_ptr<sam_state> state,
+        int                        n_threads) {
+    if (!state || !state->model || !state->state) {
+        return {};
+    }
+
+    auto async = std::make_shared<sam_async>();
+    async->state = std::move(state);
+    async->n_threads = n_threads;
+    async->worker = std::thread(sam_async_worker, std::ref(*async));
+
+    return async;
+}
+
+std::future<bool> sam_async_compute_embd_img(
+        sam_async    & async,
+        sam_image_u8   img) {
+    sam_async_request req;
+    req.is_embd = true;
+    req.img = std::move(img);
+
+    std::future<bool> res = req.res_embd.get_future();
+    {
+        std::lock_guard<std::mutex> lock(async.mutex);
+        async.nx = req.img.nx;
+        async.ny = req.img.ny;
+        async.queue.push_back(std::move(req));
+    }
+    async.cv.notify_one();
+
+    return res;
+}
+
+std::future<std::vector<sam_image_u8>> sam_async_compute_masks(
+        sam_async & async,
+        sam_point   pt,
+        int         mask_on_val,
+        int         mask_off_val,
+        bool        multimask_output) {
+    sam_async_request req;
+    req.pt = pt;
+    req.mask_on_val = mask_on_val;
+    req.mask_off_val = mask_off_val;
+    req.multimask_output = multimask_output;
+
+    std::future<std::vector<sam_image_u8>> res = req.res_masks.get_future();
+    {
+        std::lock_guard<std::mutex> lock(async.mutex);
+        req.nx = async.nx;
+        req.ny = async.ny;
+        async.queue.push_back(std::move(req));
+    }
+    async.cv.notify_one();
+
+    return res;
+}
+
+// blocking queue with a fixed capacity, closed by the producer side when done
+template <typename T>
+struct sam_bounded_queue {
+    size_t capacity = 1;
+
+    bool closed = false;
+
+    std::mutex mutex;
+    std::condition_variable cv_push;
+    std::condition_variable cv_pop;
+    std::deque<T> items;
+
+    void push(T && item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_push.wait(lock, [&]() { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        cv_pop.notify_one();
+    }
+
+    // returns false when the queue is closed and empty
+    bool pop(T & item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_pop.wait(lock, [&]() { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
         }
-        state.model.reset();
-        state.state.reset();
+        item = std::move(items.front());
+        items.pop_front();
+        cv_push.notify_one();
+        return true;
     }
 
-    if (state.model) {
-        if (state.model->backend) {
-            ggml_backend_free(state.model->backend);
-            ggml_backend_buffer_free(state.model->buffer);
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        cv_pop.notify_all();
+    }
+};
+
+struct sam_pipeline_item {
+    int id = 0;
+    bool ok = false;
+
+    int nx = 0;
+    int ny = 0;
+
+    sam_image_f32 img;
+    sam_masks_raw raw;
+};
+
+int sam_pipeline_run(
+        sam_state                   & state,
+        int                           n_images,
+        const sam_pipeline_load_fn  & load,
+        const sam_pipeline_store_fn & store,
+        const sam_pipeline_params   & params) {
+    if (!state.model || !state.state || n_images <= 0) {
+        return 0;
+    }
+
+    // an empty mask list is how a failed image is reported to the store callback
+    if (params.points.empty()) {
+        fprintf(stderr, "%s: no points to decode - at least one point is required\n", __func__);
+        return 0;
+    }
+
+    const auto & hparams = state.model->hparams;
+
+    const int n_threads_load = std::max(1, params.n_threads_load);
+    const int n_threads_post = std::max(1, params.n_threads_post);
+
+    sam_bounded_queue<sam_pipeline_item> q_enc;
+    sam_bounded_queue<sam_pipeline_item> q_post;
+
+    q_enc.capacity  = std::max(1, params.queue_size);
+    q_post.capacity = std::max(1, params.queue_size);
+
+    std::atomic<int> next_id(0);
+    std::atomic<int> n_loaders(n_threads_load);
+    std::atomic<int> n_done(0);
+
+    // load + preprocess
+    auto worker_load = [&]() {
+        for (int id = next_id++; id < n_images; id = next_id++) {
+            sam_pipeline_item item;
+            item.id = id;
+
+            sam_image_u8 img;
+            if (!load(id, img)) {
+                fprintf(stderr, "%s: failed to load image %d\n", __func__, id);
+            } else if (!sam_image_preprocess(img, item.img)) {
+                fprintf(stderr, "%s: failed to preprocess image %d\n", __func__, id);
+            } else {
+                item.nx = img.nx;
+                item.ny = img.ny;
+                item.ok = true;
+            }
+
+            q_enc.push(std::move(item));
+        }
+
+        if (--n_loaders == 0) {
+            q_enc.close();
+        }
+    };
+
+    // encode + decode - the only stage that uses the session
+    auto worker_compute = [&]() {
+        sam_pipeline_item item;
+        while (q_enc.pop(item)) {
+            if (item.ok) {
+                item.ok = sam_compute_embd_img_f32(item.img, params.n_threads, state);
+            }
+            if (item.ok) {
+                item.ok = sam_compute_masks_raw(item.nx, item.ny, params.n_threads, params.points, {}, state, params.multimask_output, item.raw);
+            }
+
+            // the preprocessed image is no longer needed
+            item.img = {};
+
+            q_post.push(std::move(item));
         }
+
+        q_post.close();
+    };
+
+    // postprocess + store
+    auto worker_post = [&]() {
+        sam_pipeline_item item;
+        while (q_post.pop(item)) {
+            std::vector<std::vector<sam_image_u8>> masks;
+            if (item.ok) {
+                masks.resize(item.raw.n_batch);
+                for (int i = 0; i < item.raw.n_batch; ++i) {
+                    masks[i] = sam_postprocess_masks(hparams, item.nx, item.ny, item.raw, params.mask_on_val, params.mask_off_val, i);
+                }
+                n_done++;
+            }
+
+            store(item.id, masks);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < n_threads_load; ++i) {
+        workers.emplace_back(worker_load);
+    }
+    for (int i = 0; i < n_threads_post; ++i) {
+        workers.emplace_back(worker_post);
+    }
+
+    worker_compute();
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    return n_done;
+}
+
+struct sam_tiled_level {
+    float scale = 1.0f;
+
+    // the image at this scale - empty for scale 1, where the original image is used
+    sam_image_u8 img;
+
+    int nx = 0;
+    int ny = 0;
+
+    std::vector<int> x0; // tile offsets along x
+    std::vector<int> y0; // tile offsets along y
+};
+
+struct sam_tiled {
+    std::shared_ptr<sam_state> state;
+
+    sam_tiled_params params;
+
+    sam_image_u8 img;
+
+    std::vector<sam_tiled_level> levels;
+
+    // tile key -> embedding saved with sam_get_embd_img, with the LRU order kept in cache_lru (front = most recently used)
+    std::list<uint64_t> cache_lru;
+    std::map<uint64_t, std::pair<std::vector<uint8_t>, std::list<uint64_t>::iterator>> cache;
+
+    // the tile whose embedding is currently in the session state
+    uint64_t key_cur = UINT64_MAX;
+};
+
+static uint64_t sam_tiled_key(int i_level, int ix, int iy) {
+    return (uint64_t(i_level) << 40) | (uint64_t(iy) << 20) | uint64_t(ix);
+}
+
+// bilinear resize of an RGB image
+static void sam_image_u8_resize(const sam_image_u8 & src, int nx, int ny, sam_image_u8 & dst) {
+    dst.nx = nx;
+    dst.ny = ny;
+    dst.data.resize(3*nx*ny);
+
+    const float sx = float(src.nx)/nx;
+    const float sy = float(src.ny)/ny;
+
+    for (int y = 0; y < ny; ++y) {
+        const float fy = std::max((y + 0.5f)*sy - 0.5f, 0.0f);
+        const int   y0 = std::min((int) fy, src.ny - 1);
+        const int   y1 = std::min(y0 + 1, src.ny - 1);
+        const float dy = fy - y0;
+
+        for (int x = 0; x < nx; ++x) {
+            const float fx = std::max((x + 0.5f)*sx - 0.5f, 0.0f);
+            const int   x0 = std::min((int) fx, src.nx - 1);
+            const int   x1 = std::min(x0 + 1, src.nx - 1);
+            const float dx = fx - x0;
+
+            for (int c = 0; c < 3; ++c) {
+                const float v00 = src.data[3*(y0*src.nx + x0) + c];
+                const float v01 = src.data[3*(y0*src.nx + x1) + c];
+                const float v10 = src.data[3*(y1*src.nx + x0) + c];
+                const float v11 = src.data[3*(y1*src.nx + x1) + c];
+
+                const float v0 = (1-dx)*v00 + dx*v01;
+                const float v1 = (1-dx)*v10 + dx*v11;
+
+                dst.data[3*(y*nx + x) + c] = (uint8_t) std::min(std::max((1-dy)*v0 + dy*v1 + 0.5f, 0.0f), 255.0f);
+            }
+        }
+    }
+}
+
+// tile offsets covering [0, n) - the last tile is aligned to the end, so all tiles are full size
+static std::vector<int> sam_tiled_offsets(int n, int tile_size, int overlap) {
+    GGML_ASSERT(0 <= overlap && overlap < tile_size);
+
+    std::vector<int> res;
+    if (n <= tile_size) {
+        res.push_back(0);
+        return res;
+    }
+
+    const int stride = tile_size - overlap;
+    for (int x = 0; ; x += stride) {
+        if (x + tile_size >= n) {
+            res.push_back(n - tile_size);
+            break;
+        }
+        res.push_back(x);
+    }
+
+    return res;
+}
+
+std::shared_ptr<sam_tiled> sam_tiled_init(
+        std::shared_ptr<sam_state>   state,
+        const sam_image_u8         & img,
+        const sam_tiled_params     & params) {
+    if (!state || !state->model || !state->state || img.nx <= 0 || img.ny <= 0 || params.tile_size <= 0) {
+        return {};
     }
+
+    // the tiles advance by tile_size - overlap pixels
+    if (params.overlap < 0 || params.overlap >= params.tile_size) {
+        fprintf(stderr, "%s: invalid overlap %d, must be in [0, %d)\n", __func__, params.overlap, params.tile_size);
+        return {};
+    }
+
+    auto tiled = std::make_shared<sam_tiled>();
+    tiled->state  = std::move(state);
+    tiled->params = params;
+    tiled->img    = img;
+
+    for (float scale : params.scales) {
+        if (scale <= 0.0f) {
+            fprintf(stderr, "%s: invalid scale %f\n", __func__, scale);
+            return {};
+        }
+
+        sam_tiled_level level;
+        level.scale = scale;
+        level.nx = std::max(1, int(img.nx*scale + 0.5f));
+        level.ny = std::max(1, int(img.ny*scale + 0.5f));
+
+        if (level.nx != img.nx || level.ny != img.ny) {
+            sam_image_u8_resize(img, level.nx, level.ny, level.img);
+        }
+
+        level.x0 = sam_tiled_offsets(level.nx, params.tile_size, params.overlap);
+        level.y0 = sam_tiled_offsets(level.ny, params.tile_size, params.overlap);
+
+        fprintf(stderr, "%s: scale %.3f: %d x %d, %d x %d tiles\n", __func__, scale, level.nx, level.ny, (int) level.x0.size(), (int) level.y0.size());
+
+        tiled->levels.push_back(std::move(level));
+    }
+
+    return tiled;
+}
+
+// make the embedding of a tile current in the session state, encoding it if it is not cached
+static bool sam_tiled_load_tile(sam_tiled & tiled, int i_level, int ix, int iy, sam_image_u8 & tile, int n_threads) {
+    const auto & level = tiled.levels[i_level];
+    const auto & src   = level.img.data.empty() ? tiled.img : level.img;
+
+    const int x0 = level.x0[ix];
+    const int y0 = level.y0[iy];
+
+    tile.nx = std::min(tiled.params.tile_size, level.nx - x0);
+    tile.ny = std::min(tiled.params.tile_size, level.ny - y0);
+
+    const uint64_t key = sam_tiled_key(i_level, ix, iy);
+    if (key == tiled.key_cur) {
+        return true;
+    }
+
+    auto it = tiled.cache.find(key);
+    if (it != tiled.cache.end()) {
+        tiled.cache_lru.splice(tiled.cache_lru.begin(), tiled.cache_lru, it->second.second);
+        if (!sam_set_embd_img(it->second.first, n_threads, *tiled.state)) {
+            tiled.key_cur = UINT64_MAX;
+            return false;
+        }
+        tiled.key_cur = key;
+        return true;
+    }
+
+    tile.data.resize(3*tile.nx*tile.ny);
+    for (int y = 0; y < tile.ny; ++y) {
+        memcpy(tile.data.data() + 3*y*tile.nx, src.data.data() + 3*((y0 + y)*level.nx + x0), 3*tile.nx);
+    }
+
+    tiled.key_cur = UINT64_MAX;
+    if (!sam_compute_embd_img(tile, n_threads, *tiled.state)) {
+        return false;
+    }
+    tiled.key_cur = key;
+
+    if (tiled.params.cache_size > 0) {
+        while ((int) tiled.cache.size() >= tiled.params.cache_size) {
+            tiled.cache.erase(tiled.cache_lru.back());
+            tiled.cache_lru.pop_back();
+        }
+
+        tiled.cache_lru.push_front(key);
+        tiled.cache[key] = { sam_get_embd_img(*tiled.state), tiled.cache_lru.begin() };
+    }
+
+    return true;
+}
+
+std::vector<sam_image_u8> sam_tiled_compute_masks(
+        sam_tiled & tiled,
+        sam_point   pt,
+        int         n_threads) {
+    const auto & params = tiled.params;
+    const int tile_size = params.tile_size;
+
+    std::vector<sam_image_u8> res;
+
+    for (int il = 0; il < (int) tiled.levels.size(); ++il) {
+        const auto & level = tiled.levels[il];
+
+        sam_image_u8 mask;
+        mask.nx = tiled.img.nx;
+        mask.ny = tiled.img.ny;
+        mask.data.resize(mask.nx*mask.ny, params.mask_off_val);
+
+        // the point in the coordinates of this level
+        const float px = pt.x*level.nx/tiled.img.nx;
+        const float py = pt.y*level.ny/tiled.img.ny;
+
+        for (int iy = 0; iy < (int) level.y0.size(); ++iy) {
+            if (py < level.y0[iy] || py >= level.y0[iy] + tile_size) {
+                continue;
+            }
+            for (int ix = 0; ix < (int) level.x0.size(); ++ix) {
+                if (px < level.x0[ix] || px >= level.x0[ix] + tile_size) {
+                    continue;
+                }
+
+                sam_image_u8 tile;
+                if (!sam_tiled_load_tile(tiled, il, ix, iy, tile, n_threads)) {
+                    fprintf(stderr, "%s: failed to encode tile (%d, %d) at scale %.3f\n", __func__, ix, iy, level.scale);
+                    continue;
+                }
+
+                const sam_point pt_tile = { px - level.x0[ix], py - level.y0[iy] };
+
+                // only the tile size is used for the mask computation
+                auto masks = sam_compute_masks(tile, n_threads, pt_tile, *tiled.state, 1, 0, params.multimask_output);
+                if (masks.empty()) {
+                    continue;
+                }
+
+                // the masks are sorted by score - stitch the best one
+                const auto & best = masks[0];
+
+                const int x0 = level.x0[ix];
+                const int y0 = level.y0[iy];
+
+                // the footprint of the tile in the full image
+                const int ox0 = std::max(0, int(x0/level.scale));
+                const int oy0 = std::max(0, int(y0/level.scale));
+                const int ox1 = std::min(mask.nx, int((x0 + best.nx)/level.scale + 0.5f));
+                const int oy1 = std::min(mask.ny, int((y0 + best.ny)/level.scale + 0.5f));
+
+                for (int oy = oy0; oy < oy1; ++oy) {
+                    const int ty = std::min(int(oy*level.scale) - y0, best.ny - 1);
+                    if (ty < 0) {
+                        continue;
+                    }
+                    for (int ox = ox0; ox < ox1; ++ox) {
+                        const int tx = std::min(int(ox*level.scale) - x0, best.nx - 1);
+                        if (tx >= 0 && best.data[ty*best.nx + tx]) {
+                            mask.data[oy*mask.nx + ox] = params.mask_on_val;
+                        }
+                    }
+                }
+            }
+        }
+
+        res.push_back(std::move(mask));
+    }
+
+    return res;
+}
+
+struct sam_video_object {
+    sam_point pt;
+
+    // low-res logits of the previous mask, empty if there is none
+    std::vector<float> mask_logits;
+};
+
+struct sam_video {
+    std::shared_ptr<sam_state> state;
+
+    sam_video_params params;
+
+    std::vector<sam_video_object> objects;
+
+    // subsampled copy of the last encoded frame
+    int nx = 0;
+    int ny = 0;
+    std::vector<uint8_t> ref;
+
+    int n_frames  = 0;
+    int n_encoded = 0;
+};
+
+// step of the grid used for the frame difference
+static const int SAM_VIDEO_DIFF_STEP = 8;
+
+static std::vector<uint8_t> sam_video_subsample(const sam_image_u8 & img) {
+    std::vector<uint8_t> res;
+    res.reserve(3*(img.nx/SAM_VIDEO_DIFF_STEP + 1)*(img.ny/SAM_VIDEO_DIFF_STEP + 1));
+
+    for (int y = SAM_VIDEO_DIFF_STEP/2; y < img.ny; y += SAM_VIDEO_DIFF_STEP) {
+        for (int x = SAM_VIDEO_DIFF_STEP/2; x < img.nx; x += SAM_VIDEO_DIFF_STEP) {
+            const uint8_t * p = img.data.data() + 3*(y*img.nx + x);
+            res.push_back(p[0]);
+            res.push_back(p[1]);
+            res.push_back(p[2]);
+        }
+    }
+
+    return res;
+}
+
+std::shared_ptr<sam_video> sam_video_init(
+        std::shared_ptr<sam_state>   state,
+        const sam_video_params     & params) {
+    if (!state || !state->model || !state->state) {
+        return {};
+    }
+
+    auto video = std::make_shared<sam_video>();
+    video->state  = std::move(state);
+    video->params = params;
+
+    if (params.use_mask_prompt && !video->state->model->enc_prompt.has_mask_down) {
+        fprintf(stderr, "%s: the model has no mask_downscaling weights - the previous masks will not be used as prompts\n", __func__);
+        video->params.use_mask_prompt = false;
+    }
+
+    return video;
+}
+
+void sam_video_set_points(
+        sam_video                    & video,
+        const std::vector<sam_point> & points) {
+    video.objects.clear();
+    for (const auto & pt : points) {
+        sam_video_object obj;
+        obj.pt = pt;
+        video.objects.push_back(std::move(obj));
+    }
+}
+
+std::vector<sam_image_u8> sam_video_process_frame(
+        sam_video          & video,
+        const sam_image_u8 & frame,
+        int                  n_threads) {
+    const auto & params = video.params;
+
+    video.n_frames++;
+
+    // encode the frame only if it changed enough since the last encoded one
+    {
+        std::vector<uint8_t> cur = sam_video_subsample(frame);
+
+        bool reuse = frame.nx == video.nx && frame.ny == video.ny && cur.size() == video.ref.size() && !cur.empty();
+        if (reuse) {
+            int64_t sum = 0;
+            for (size_t i = 0; i < cur.size(); ++i) {
+                sum += std::abs(int(cur[i]) - int(video.ref[i]));
+            }
+            reuse = float(sum)/cur.size() < params.diff_threshold;
+        }
+
+        if (!reuse) {
+            if (!sam_compute_embd_img(frame, n_threads, *video.state)) {
+                fprintf(stderr, "%s: failed to encode frame %d\n", __func__, video.n_frames - 1);
+                video.ref.clear();
+                return {};
+            }
+
+            video.nx  = frame.nx;
+            video.ny  = frame.ny;
+            video.ref = std::move(cur);
+            video.n_encoded++;
+        }
+    }
+
+    std::vector<sam_image_u8> res;
+
+    for (auto & obj : video.objects) {
+        const bool has_mask = params.use_mask_prompt && !obj.mask_logits.empty();
+
+        // with a mask prompt the prompt is no longer ambiguous, so a single mask is requested
+        const bool multimask_output = !has_mask;
+
+        sam_masks_raw raw;
+        if (!sam_compute_masks_raw(frame.nx, frame.ny, n_threads, { obj.pt }, has_mask ? obj.mask_logits : std::vector<float>(), *video.state, multimask_output, raw)) {
+            res.emplace_back();
+            obj.mask_logits.clear();
+            continue;
+        }
+
+        // the mask with the highest predicted iou
+        int i_best = 0;
+        for (int i = 1; i < raw.n_masks; ++i) {
+            if (raw.iou_predictions[i] > raw.iou_predictions[i_best]) {
+                i_best = i;
+            }
+        }
+
+        // keep only the selected mask, so that the postprocessing does not upscale the others
+        sam_masks_raw best;
+        best.ne0 = raw.ne0;
+        best.ne1 = raw.ne1;
+        best.n_masks = 1;
+        best.n_batch = 1;
+        best.low_res_masks.assign(raw.low_res_masks.begin() + i_best*raw.ne0*raw.ne1, raw.low_res_masks.begin() + (i_best + 1)*raw.ne0*raw.ne1);
+        best.iou_predictions.assign(1, raw.iou_predictions[i_best]);
+
+        auto masks = sam_postprocess_masks(video.state->model->hparams, frame.nx, frame.ny, best, params.mask_on_val, params.mask_off_val, 0);
+        if (masks.empty()) {
+            // lost - retry from the point alone on the next frame
+            res.emplace_back();
+            obj.mask_logits.clear();
+            continue;
+        }
+
+        obj.mask_logits = std::move(best.low_res_masks);
+
+        if (params.track_points) {
+            int64_t sx = 0;
+            int64_t sy = 0;
+            int64_t n  = 0;
+            for (int y = 0; y < masks[0].ny; ++y) {
+                for (int x = 0; x < masks[0].nx; ++x) {
+                    if (masks[0].data[y*masks[0].nx + x] == params.mask_on_val) {
+                        sx += x;
+                        sy += y;
+                        n++;
+                    }
+                }
+            }
+
+            // the centroid of a non-convex object can lie outside of it - keep the old point in that case
+            if (n > 0) {
+                const int cx = int(sx/n);
+                const int cy = int(sy/n);
+                if (masks[0].data[cy*masks[0].nx + cx] == params.mask_on_val) {
+                    obj.pt = { float(cx), float(cy) };
+                }
+            }
+        }
+
+        res.push_back(std::move(masks[0]));
+    }
+
+    return res;
 }
@@ -5,6 +5,8 @@
 #include <string>
 #include <thread>
 #include <memory>
+#include <future>
+#include <functional>
 
 struct sam_point {
     float x = 0;
@@ -19,6 +21,31 @@ struct sam_image_u8 {
     std::vector<uint8_t> data;
 };
 
+enum sam_pixel_format {
+    SAM_PIXEL_FORMAT_RGB,
+    SAM_PIXEL_FORMAT_BGR,
+    SAM_PIXEL_FORMAT_RGBA,
+    SAM_PIXEL_FORMAT_BGRA,
+};
+
+// an image in caller-owned memory, read directly by the preprocessing without an intermediate copy
+struct sam_image_view {
+    const uint8_t * data = nullptr;
+
+    int nx = 0;
+    int ny = 0;
+    int stride = 0; // bytes between the starts of two rows (>= nx * bytes per pixel), 0 if the rows are tightly packed
+
+    sam_pixel_format format = SAM_PIXEL_FORMAT_RGB;
+};
+
+// storage type of the image embedding computed by sam_compute_embd_img
+enum sam_embd_type {
+    SAM_EMBD_TYPE_F32,
+    SAM_EMBD_TYPE_F16, // 2x smaller
+    SAM_EMBD_TYPE_I8,  // 4x smaller - int8 with one scale per channel
+};
+
 struct sam_params {
     int32_t seed      = -1; // RNG seed
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
@@ -26,34 +53,241 @@ struct sam_params {
     std::string model     = "../checkpoints/ggml-model-f16-b.bin"; // model path
     std::string fname_inp = "../img.jpg";
     std::string fname_out = "img.out";
+
+    // compute the image-only inputs of the mask decoder once per image instead of on every sam_compute_masks call
+    bool precompute_dec_kv = true;
+
+    // store the keys and values of the image encoder attention in F16 instead of F32 - halves their memory traffic
+    // at a small loss of accuracy. Q, the softmax and the residual stream stay in F32. ignored when built with BLAS
+    bool f16_activations = false;
+
+    // the embedding is converted back to F32 by the mask decoder, so the smaller types only cost accuracy
+    sam_embd_type embd_type = SAM_EMBD_TYPE_F32;
+
+    // benchmark the encoder and the decoder at load time and use the fastest thread count for each
+    // the result is stored in autotune_cache and reused on the next load. if empty, "<model>.autotune" is used
+    bool autotune = false;
+    std::string autotune_cache;
 };
 
 struct sam_ggml_state;
 struct sam_ggml_model;
+
+// an inference session: the per-image state plus a reference to the (immutable) model weights
+// sessions created with sam_new_session share the model and can be used concurrently from different threads,
+// but a single session must only be used by one thread at a time
 struct sam_state {
     std::unique_ptr<sam_ggml_state> state;
-    std::unique_ptr<sam_ggml_model> model;
+    std::shared_ptr<const sam_ggml_model> model;
     int t_load_ms = 0;
     int t_compute_img_ms = 0;
     int t_compute_masks_ms = 0;
+
+    // size in bytes of the compute buffer needed by the decoder graph of the last sam_compute_masks call
+    size_t mem_compute_masks = 0;
+
+    // time of the last sam_compute_masks call spent computing the decoder graph alone, without building the graph
+    // and without the pre- and postprocessing
+    int64_t t_compute_masks_graph_us = 0;
+
+    // thread counts picked by sam_params.autotune - if > 0, they override the n_threads arguments
+    int n_threads_enc = 0;
+    int n_threads_dec = 0;
 };
 
 std::shared_ptr<sam_state> sam_load_model(
         const sam_params & params);
 
+// create a new session that shares the model of an already loaded state
+std::shared_ptr<sam_state> sam_new_session(
+        const sam_state & state);
+
 bool sam_compute_embd_img(
         const sam_image_u8 & img,
         int                  n_threads ,
         sam_state          & state);
 
+bool sam_compute_embd_img(
+        const sam_image_view & img,
+        int                    n_threads,
+        sam_state            & state);
+
+// the image embedding of the last sam_compute_embd_img call, in the format selected by sam_params.embd_type
+// it can be stored (e.g. in a cache or on disk) and restored later with sam_set_embd_img instead of encoding the
+// image again. returns an empty vector if there is no embedding
+std::vector<uint8_t> sam_get_embd_img(
+        const sam_state & state);
+
+// the embedding must come from a model loaded with the same embd_type
+bool sam_set_embd_img(
+        const std::vector<uint8_t> & embd,
+        int                          n_threads,
+        sam_state                  & state);
+
 // returns masks sorted by the sum of the iou_score and stability_score in descending order
+// if multimask_output is false, only the single-mask token is decoded and at most one mask is returned
 std::vector<sam_image_u8> sam_compute_masks(
         const sam_image_u8 & img,
         int                  n_threads,
         sam_point            pt,
         sam_state          & state,
-        int                  mask_on_val  = 255,
-        int                  mask_off_val = 0);
+        int                  mask_on_val      = 255,
+        int                  mask_off_val     = 0,
+        bool                 multimask_output = true);
+
+// decode several point prompts on the same image in a single batched graph
+// returns one list of masks per point, each sorted as in sam_compute_masks
+std::vector<std::vector<sam_image_u8>> sam_compute_masks_batch(
+        int                            nx,
+        int                            ny,
+        int                            n_threads,
+        const std::vector<sam_point> & points,
+        sam_state                    & state,
+        int                            mask_on_val      = 255,
+        int                            mask_off_val     = 0,
+        bool                           multimask_output = true);
 
 void sam_deinit(
         sam_state & state);
+
+//
+// async API
+//
+// the requests are executed in submission order by a worker thread that owns the session
+// consecutive mask requests are decoded together in one batched graph
+//
+
+struct sam_async;
+
+std::shared_ptr<sam_async> sam_async_init(
+        std::shared_ptr<sam_state> state,
+        int                        n_threads);
+
+std::future<bool> sam_async_compute_embd_img(
+        sam_async    & async,
+        sam_image_u8   img);
+
+// the masks are computed for the most recently submitted image
+std::future<std::vector<sam_image_u8>> sam_async_compute_masks(
+        sam_async & async,
+        sam_point   pt,
+        int         mask_on_val      = 255,
+        int         mask_off_val     = 0,
+        bool        multimask_output = true);
+
+//
+// pipeline API
+//
+// throughput mode for processing many images: loading + preprocessing, encoding + decoding and
+// postprocessing + storing run concurrently on separate threads, connected by bounded queues
+//
+
+struct sam_pipeline_params {
+    int n_threads      = std::min(4, (int32_t) std::thread::hardware_concurrency()); // encoder/decoder threads
+    int n_threads_load = 1; // threads running the load callback and the preprocessing
+    int n_threads_post = 1; // threads running the postprocessing and the store callback
+    int queue_size     = 2; // max number of images waiting between two stages
+
+    // prompts decoded for every image, in the coordinates of the loaded image - at least one is required
+    std::vector<sam_point> points;
+
+    int  mask_on_val      = 255;
+    int  mask_off_val     = 0;
+    bool multimask_output = true;
+};
+
+// load image i, return false on failure. called concurrently from the load threads
+using sam_pipeline_load_fn = std::function<bool(int i, sam_image_u8 & img)>;
+
+// store the masks of image i - one list per point, empty if the image failed. called concurrently from the postprocessing threads
+using sam_pipeline_store_fn = std::function<void(int i, std::vector<std::vector<sam_image_u8>> & masks)>;
+
+// process images [0, n_images), returns the number of successfully processed images
+int sam_pipeline_run(
+        sam_state                   & state,
+        int                           n_images,
+        const sam_pipeline_load_fn  & load,
+        const sam_pipeline_store_fn & store,
+        const sam_pipeline_params   & params);
+
+//
+// tiled API
+//
+// segmentation of images much larger than the model input: the image is split into overlapping tiles at one or
+// more scales, every tile is encoded separately at full model resolution and the masks of the tiles that contain
+// the prompt are stitched together. the tile embeddings are cached, so prompts in an already visited region only
+// run the decoder
+//
+// the tiled session takes over the state - it must not be used for other images while the tiled session is alive
+//
+
+struct sam_tiled_params {
+    int tile_size = 1024; // tile size in pixels of the scaled image
+    int overlap   = 128;  // overlap of neighbouring tiles in pixels of the scaled image, in [0, tile_size)
+
+    // the image is tiled at each of these scales - smaller scales produce fewer, coarser tiles for large objects
+    std::vector<float> scales = { 1.0f };
+
+    // max number of tile embeddings kept in memory (least recently used are dropped first)
+    int cache_size = 16;
+
+    int  mask_on_val      = 255;
+    int  mask_off_val     = 0;
+    bool multimask_output = true;
+};
+
+struct sam_tiled;
+
+std::shared_ptr<sam_tiled> sam_tiled_init(
+        std::shared_ptr<sam_state>   state,
+        const sam_image_u8         & img,
+        const sam_tiled_params     & params);
+
+// returns one full resolution mask per scale - the union of the best masks of all tiles at that scale that
+// contain the point. the point is in the coordinates of the full image
+std::vector<sam_image_u8> sam_tiled_compute_masks(
+        sam_tiled & tiled,
+        sam_point   pt,
+        int         n_threads);
+
+//
+// video API
+//
+// tracks point prompts over the frames of a video:
+//
+// - a frame is only encoded if it differs enough from the last encoded frame, otherwise its embedding is reused
+// - every prompt follows its object - the next point is the centroid of the previous mask
+// - the low-res logits of the previous mask are fed back as a mask prompt (if the model file contains the
+//   mask_downscaling weights)
+//
+// the video session takes over the state - it must not be used for other images while the video session is alive
+//
+
+struct sam_video_params {
+    // mean absolute pixel difference (0-255) of a subsampled frame below which the last embedding is reused
+    float diff_threshold = 2.0f;
+
+    bool track_points    = true;
+    bool use_mask_prompt = true;
+
+    int mask_on_val  = 255;
+    int mask_off_val = 0;
+};
+
+struct sam_video;
+
+std::shared_ptr<sam_video> sam_video_init(
+        std::shared_ptr<sam_state>   state,
+        const sam_video_params     & params);
+
+// (re)set the tracked prompts, in the coordinates of the frames
+void sam_video_set_points(
+        sam_video                    & video,
+        const std::vector<sam_point> & points);
+
+// process the next frame, returns one mask per tracked prompt (empty if the object was lost in this frame)
+std::vector<sam_image_u8> sam_video_process_frame(
+        sam_video          & video,
+        const sam_image_u8 & frame,
+        int                  n_threads);
+